@@ -59,7 +59,8 @@
 #define VERSION	"1.0.2"
 
 
-static int	opt_q,				// be quiet
+static int	opt_c,				// compact a VHD image
+		opt_q,				// be quiet
 		opt_r,				// create raw image
 		opt_s,				// create sparse file
 		opt_v;				// verbose mode
@@ -72,16 +73,37 @@ usage(void)
 	"Usage: vhdcvt [-qv] [-o out_file] [-s] image.img\n");
     fprintf(stderr,
 	"       vhdcvt [-qv] [-o out_file] [-r] image.vhd\n");
+    fprintf(stderr,
+	"       vhdcvt [-qv] [-o out_file] -c image.vhd\n");
     fprintf(stderr,
 	"\nIf -r is used, conversion from VHD to RAW will be attempted.\n"
 	"Otherwise, the (raw) input file will be converted to a VHD\n"
-	"image, optionally in SPARSE mode if the -s option is present.\n\n");
+	"image, optionally in SPARSE mode if the -s option is present.\n"
+	"If -c is used, the unused blocks of a sparse or differencing\n"
+	"VHD image are removed, replacing the image unless -o is given.\n\n");
 
     exit(1);
     /*NOTREACHED*/
 }
 
 
+/* Replace a file with another one, atomically where the OS can do that. */
+static int
+replace_file(const char *from, const char *to)
+{
+    if (rename(from, to) == 0)
+	return(0);
+
+#ifdef _WIN32
+    /* Windows does not rename over an existing file. */
+    if (remove(to) == 0 && rename(from, to) == 0)
+	return(0);
+#endif
+
+    return(-1);
+}
+
+
 int
 main(int argc, char *argv[])
 {
@@ -92,11 +114,15 @@ main(int argc, char *argv[])
     int c;
 
     /* Set defaults. */
-    opt_q = opt_r = opt_s = opt_v = 0;
+    opt_c = opt_q = opt_r = opt_s = opt_v = 0;
     outname = NULL;
 
     opterr = 0;
-    while ((c = getopt(argc, argv, "o:qrsv")) != EOF) switch(c) {
+    while ((c = getopt(argc, argv, "co:qrsv")) != EOF) switch(c) {
+	case 'c':	// compact a VHD image
+		opt_c ^= 1;
+		break;
+
 	case 'q':	// be quiet
 		opt_s = 1;
 		break;
@@ -139,6 +165,10 @@ main(int argc, char *argv[])
 	fprintf(stderr, "The -o and -r options cannot be combined!\n");
 	usage();
     }
+    if (opt_c && (opt_r || opt_s)) {
+	fprintf(stderr, "The -c option cannot be combined with -r or -s!\n");
+	usage();
+    }
     if (outname && ((argc -optind) > 1)) {
 	fprintf(stderr, "The -o option cannot be used when multiple files are to be converted!\n");
 	usage();
@@ -153,7 +183,15 @@ main(int argc, char *argv[])
 	name = argv[optind++];
 
 	/* Generate suitable filename if none given. */
-	if (outname == NULL) {
+	if (opt_c) {
+		/* Compacting in place goes through a temporary file. */
+		if (outname == NULL) {
+			strncpy(temp, name, sizeof(temp) - 5);
+			strcat(temp, ".tmp");
+			sp = temp;
+		} else
+			sp = outname;
+	} else if (outname == NULL) {
 		strncpy(temp, name, sizeof(temp) - 5);
 		if ((sp = strchr(temp, '.')) != NULL)
 			*sp = '\0';
@@ -168,7 +206,28 @@ main(int argc, char *argv[])
 	/* Set "no error". */
 	c = 0;
 
-	if (opt_r) {
+	if (opt_c) {
+		/* Compact a sparse or differencing VHD image. */
+		if (! opt_q)
+			printf("Compacting VHD '%s'.\n", name);
+
+		vhd = mvhd_compact(name, sp, &c);
+		if (vhd != NULL) {
+			mvhd_close(vhd);
+
+			/* A stale parent timestamp is only a warning. */
+			if (c == MVHD_ERR_TIMESTAMP) {
+				if (! opt_q)
+					printf("Warning: %s\n", mvhd_strerr(c));
+				c = 0;
+			}
+			if (outname == NULL && replace_file(sp, name) != 0)
+				c = MVHD_ERR_FILE;
+		} else if (outname == NULL) {
+			/* Do not leave a partial copy behind. */
+			remove(sp);
+		}
+	} else if (opt_r) {
 		/* Convert a VHD image to a RAW image. */
 		if (! opt_q)
 			printf("Converting VHD '%s' to RAW image.\n", name);
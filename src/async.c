@@ -0,0 +1,444 @@
+/*
+ * MiniVHD	Minimalist VHD implementation in C.
+ *
+ *		This file is part of the MiniVHD Project.
+ *
+ *		Asynchronous sector I/O, using a pool of worker threads.
+ *
+ * Version:	@(#)async.c	1.0.0	2026/10/16
+ *
+ * Authors:	Sherman Perry, <shermperry@gmail.com>
+ *		Fred N. van Kempen, <waltje@varcem.com>
+ *
+ *		Copyright 2019-2021 Sherman Perry.
+ *		Copyright 2021 Fred N. van Kempen.
+ *
+ *		MIT License
+ *
+ *		Permission is hereby granted, free of  charge, to any person
+ *		obtaining a copy of this software  and associated documenta-
+ *		tion files (the "Software"), to deal in the Software without
+ *		restriction, including without limitation the rights to use,
+ *		copy, modify, merge, publish, distribute, sublicense, and/or
+ *		sell copies of  the Software, and  to permit persons to whom
+ *		the Software is furnished to do so, subject to the following
+ *		conditions:
+ *
+ *		The above  copyright notice and this permission notice shall
+ *		be included in  all copies or  substantial  portions of  the
+ *		Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING  BUT NOT LIMITED TO THE  WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN  NO EVENT  SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER  IN AN ACTION OF  CONTRACT, TORT OR  OTHERWISE, ARISING
+ * FROM, OUT OF  O R IN  CONNECTION WITH THE  SOFTWARE OR  THE USE  OR  OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __linux__
+# include <sys/eventfd.h>
+# include <unistd.h>
+#endif
+#define BUILDING_LIBRARY
+#include "minivhd.h"
+#include "internal.h"
+
+
+/* Number of worker threads in the pool */
+#define MVHD_ASYNC_WORKERS 4
+
+
+typedef struct MVHDAsyncReq {
+    struct MVHDAsyncReq* next;
+    MVHDMeta*	vhdm;
+    uint32_t	offset;
+    int		num_sectors;
+    void*	buff;
+    bool	write;
+    bool	running;
+    bool	deferred;	/* completion goes to the image's done list */
+    int		result;
+    mvhd_async_callback callback;
+    void*	user_data;
+} MVHDAsyncReq;
+
+/* Asynchronous I/O state of an image */
+typedef struct MVHDAsync {
+    int		active;		/* requests queued or running */
+    int		running;
+    bool	deferred;	/* callbacks are run by mvhd_async_reap() */
+    int		event_fd;
+    MVHDAsyncReq* done_head;
+    MVHDAsyncReq* done_tail;
+} MVHDAsync;
+
+
+static MVHDOnce pool_once;
+static MVHDMutex* pool_lock;
+static MVHDCond* pool_work;	/* a request may have become runnable */
+static MVHDCond* pool_done;	/* a request has finished */
+static MVHDAsyncReq* queue_head;	/* all queued and running requests, oldest first */
+static MVHDAsyncReq* queue_tail;
+static int num_workers;
+
+
+/**
+ * \brief Check if two requests on the same image must not be reordered
+ */
+static bool
+reqs_conflict(const MVHDAsyncReq* a, const MVHDAsyncReq* b)
+{
+    if (!a->write && !b->write) {
+        return false;
+    }
+
+    return a->offset < (b->offset + (uint32_t)b->num_sectors) && b->offset < (a->offset + (uint32_t)a->num_sectors);
+}
+
+
+/**
+ * \brief Find the oldest request that may be started now
+ * 
+ * Overlapping requests on an image are started in the order they were 
+ * submitted. As the read and write engines keep per-image state (like the 
+ * sector bitmap cache), only one request per image runs at a time, unless 
+ * the image was opened in thread-safe mode.
+ * 
+ * Must be called with pool_lock held.
+ */
+static MVHDAsyncReq *
+next_runnable(void)
+{
+    MVHDAsyncReq* req;
+    MVHDAsyncReq* prev;
+
+    for (req = queue_head; req != NULL; req = req->next) {
+        if (req->running || (req->vhdm->locks == NULL && req->vhdm->async->running > 0)) {
+            continue;
+        }
+        for (prev = queue_head; prev != req; prev = prev->next) {
+            if (prev->vhdm == req->vhdm && reqs_conflict(prev, req)) {
+                break;
+            }
+        }
+        if (prev == req) {
+            return req;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * \brief Remove a request from the queue. Must be called with pool_lock held.
+ */
+static void
+unlink_req(MVHDAsyncReq* req)
+{
+    MVHDAsyncReq** pp;
+    MVHDAsyncReq* prev = NULL;
+
+    for (pp = &queue_head; *pp != req; pp = &(*pp)->next) {
+        prev = *pp;
+    }
+    *pp = req->next;
+    if (queue_tail == req) {
+        queue_tail = prev;
+    }
+    req->next = NULL;
+}
+
+
+static int
+run_req(MVHDAsyncReq* req)
+{
+    if (req->write) {
+        return mvhd_write_sectors(req->vhdm, req->offset, req->num_sectors, req->buff);
+    }
+
+    return mvhd_read_sectors(req->vhdm, req->offset, req->num_sectors, req->buff);
+}
+
+
+static void
+worker_main(void* arg)
+{
+    MVHDAsyncReq* req;
+    MVHDAsync* async;
+#ifdef __linux__
+    uint64_t one = 1;
+#endif
+
+    (void)arg;
+
+    mvhd_mutex_lock(pool_lock);
+    for (;;) {
+        req = next_runnable();
+        if (req == NULL) {
+            mvhd_cond_wait(pool_work, pool_lock);
+            continue;
+        }
+        async = req->vhdm->async;
+        req->running = true;
+        req->deferred = async->deferred;
+        async->running++;
+        mvhd_mutex_unlock(pool_lock);
+
+        req->result = run_req(req);
+
+        /* Keep the request queued until it's called back, so that overlapping ones complete in order */
+        if (!req->deferred && req->callback != NULL) {
+            req->callback(req->vhdm, req->result, req->user_data);
+        }
+
+        mvhd_mutex_lock(pool_lock);
+        unlink_req(req);
+        async->running--;
+        async->active--;
+        if (req->deferred) {
+            if (async->done_tail != NULL) {
+                async->done_tail->next = req;
+            } else {
+                async->done_head = req;
+            }
+            async->done_tail = req;
+#ifdef __linux__
+            if (write(async->event_fd, &one, sizeof one) < 0) {
+                /* Can only fail if the counter overflows, and then it's readable anyway */
+            }
+#endif
+        } else {
+            free(req);
+        }
+        mvhd_cond_broadcast(pool_work);
+        mvhd_cond_broadcast(pool_done);
+    }
+}
+
+
+static void
+pool_init(void)
+{
+    int i;
+
+    pool_lock = mvhd_mutex_create();
+    pool_work = mvhd_cond_create();
+    pool_done = mvhd_cond_create();
+    if (pool_lock == NULL || pool_work == NULL || pool_done == NULL) {
+        return;
+    }
+
+    for (i = 0; i < MVHD_ASYNC_WORKERS; i++) {
+        if (mvhd_thread_start(worker_main, NULL) == 0) {
+            num_workers++;
+        }
+    }
+}
+
+
+/**
+ * \brief Get (or create) the asynchronous I/O state of an image. Must be called with pool_lock held.
+ */
+static MVHDAsync *
+get_async(MVHDMeta* vhdm)
+{
+    if (vhdm->async == NULL) {
+        vhdm->async = calloc(1, sizeof *vhdm->async);
+        if (vhdm->async != NULL) {
+            vhdm->async->event_fd = -1;
+        }
+    }
+
+    return vhdm->async;
+}
+
+
+static int
+submit_req(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* buff, bool write, mvhd_async_callback callback, void* user_data, int* err)
+{
+    MVHDAsyncReq* req;
+    MVHDAsync* async;
+
+    if (vhdm == NULL || buff == NULL || num_sectors < 0) {
+        *err = MVHD_ERR_INVALID_PARAMS;
+        return -1;
+    }
+
+    mvhd_once(&pool_once, pool_init);
+
+    req = calloc(1, sizeof *req);
+    if (req == NULL) {
+        *err = MVHD_ERR_MEM;
+        return -1;
+    }
+    req->vhdm = vhdm;
+    req->offset = offset;
+    req->num_sectors = num_sectors;
+    req->buff = buff;
+    req->write = write;
+    req->callback = callback;
+    req->user_data = user_data;
+
+    if (num_workers == 0) {
+        /* No threads to be had, so just do it now */
+        req->result = run_req(req);
+        if (callback != NULL) {
+            callback(vhdm, req->result, user_data);
+        }
+        free(req);
+        return 0;
+    }
+
+    mvhd_mutex_lock(pool_lock);
+    async = get_async(vhdm);
+    if (async == NULL) {
+        mvhd_mutex_unlock(pool_lock);
+        free(req);
+        *err = MVHD_ERR_MEM;
+        return -1;
+    }
+    async->active++;
+    if (queue_tail != NULL) {
+        queue_tail->next = req;
+    } else {
+        queue_head = req;
+    }
+    queue_tail = req;
+    mvhd_cond_signal(pool_work);
+    mvhd_mutex_unlock(pool_lock);
+
+    return 0;
+}
+
+
+MVHDAPI int
+mvhd_read_sectors_async(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff, mvhd_async_callback callback, void* user_data, int* err)
+{
+    return submit_req(vhdm, offset, num_sectors, out_buff, false, callback, user_data, err);
+}
+
+
+MVHDAPI int
+mvhd_write_sectors_async(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff, mvhd_async_callback callback, void* user_data, int* err)
+{
+    return submit_req(vhdm, offset, num_sectors, in_buff, true, callback, user_data, err);
+}
+
+
+MVHDAPI int
+mvhd_async_event_fd(MVHDMeta* vhdm)
+{
+#ifdef __linux__
+    MVHDAsync* async;
+    int fd = -1;
+
+    mvhd_once(&pool_once, pool_init);
+    if (num_workers == 0) {
+        return -1;
+    }
+
+    mvhd_mutex_lock(pool_lock);
+    async = get_async(vhdm);
+    if (async != NULL) {
+        if (async->event_fd < 0) {
+            async->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (async->event_fd < 0) {
+                mvhd_errno = errno;
+            }
+        }
+        async->deferred = (async->event_fd >= 0);
+        fd = async->event_fd;
+    }
+    mvhd_mutex_unlock(pool_lock);
+
+    return fd;
+#else
+    (void)vhdm;
+
+    return -1;
+#endif
+}
+
+
+MVHDAPI int
+mvhd_async_reap(MVHDMeta* vhdm)
+{
+    MVHDAsyncReq* req;
+    MVHDAsyncReq* next;
+    int n = 0;
+#ifdef __linux__
+    uint64_t count;
+#endif
+
+    if (vhdm->async == NULL) {
+        return 0;
+    }
+
+#ifdef __linux__
+    /* Reset the event first, so that nothing completing from now on goes unnoticed */
+    if (vhdm->async->event_fd >= 0 && read(vhdm->async->event_fd, &count, sizeof count) < 0) {
+        /* EAGAIN, there was nothing to reset */
+    }
+#endif
+
+    mvhd_mutex_lock(pool_lock);
+    req = vhdm->async->done_head;
+    vhdm->async->done_head = NULL;
+    vhdm->async->done_tail = NULL;
+    mvhd_mutex_unlock(pool_lock);
+
+    for (; req != NULL; req = next) {
+        next = req->next;
+        if (req->callback != NULL) {
+            req->callback(vhdm, req->result, req->user_data);
+        }
+        free(req);
+        n++;
+    }
+
+    return n;
+}
+
+
+MVHDAPI void
+mvhd_async_wait(MVHDMeta* vhdm)
+{
+    if (vhdm->async == NULL) {
+        return;
+    }
+
+    mvhd_mutex_lock(pool_lock);
+    while (vhdm->async->active > 0) {
+        mvhd_cond_wait(pool_done, pool_lock);
+    }
+    mvhd_mutex_unlock(pool_lock);
+
+    mvhd_async_reap(vhdm);
+}
+
+
+void
+mvhd_async_free(MVHDMeta* vhdm)
+{
+    if (vhdm->async == NULL) {
+        return;
+    }
+
+    mvhd_async_wait(vhdm);
+
+#ifdef __linux__
+    if (vhdm->async->event_fd >= 0) {
+        close(vhdm->async->event_fd);
+    }
+#endif
+    free(vhdm->async);
+    vhdm->async = NULL;
+}
@@ -0,0 +1,211 @@
+/*
+ * MiniVHD	Minimalist VHD implementation in C.
+ *
+ *		This file is part of the MiniVHD Project.
+ *
+ *		Benchmark for parallel reads from one image in thread-safe mode.
+ *
+ * Version:	@(#)bench.c 	1.0.0	2026/10/16
+ *
+ * Authors:	Sherman Perry, <shermperry@gmail.com>
+ *		Fred N. van Kempen, <waltje@varcem.com>
+ *
+ *		Copyright 2019-2021 Sherman Perry.
+ *		Copyright 2021 Fred N. van Kempen.
+ *
+ *		MIT License
+ *
+ *		Permission is hereby granted, free of  charge, to any person
+ *		obtaining a copy of this software  and associated documenta-
+ *		tion files (the "Software"), to deal in the Software without
+ *		restriction, including without limitation the rights to use,
+ *		copy, modify, merge, publish, distribute, sublicense, and/or
+ *		sell copies of  the Software, and  to permit persons to whom
+ *		the Software is furnished to do so, subject to the following
+ *		conditions:
+ *
+ *		The above  copyright notice and this permission notice shall
+ *		be included in  all copies or  substantial  portions of  the
+ *		Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING  BUT NOT LIMITED TO THE  WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN  NO EVENT  SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER  IN AN ACTION OF  CONTRACT, TORT OR  OTHERWISE, ARISING
+ * FROM, OUT OF  O R IN  CONNECTION WITH THE  SOFTWARE OR  THE USE  OR  OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <minivhd.h>
+
+
+#define MAX_THREADS	16
+#define SECTOR_SIZE	512
+#define READ_SECTORS	8		/* 4 KB per read */
+
+
+typedef struct Worker {
+    MVHDMeta*	vhdm;
+    uint32_t	num_sectors;
+    unsigned	seed;
+    volatile bool* stop;
+    uint64_t	reads;
+} Worker;
+
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+static void *
+worker_main(void* arg)
+{
+    Worker* w = (Worker*)arg;
+    uint8_t buff[READ_SECTORS * SECTOR_SIZE];
+    uint32_t offset;
+
+    while (! *w->stop) {
+        offset = (uint32_t)rand_r(&w->seed) % (w->num_sectors - READ_SECTORS);
+        mvhd_read_sectors(w->vhdm, offset, READ_SECTORS, buff);
+        w->reads++;
+    }
+
+    return NULL;
+}
+
+
+/* Fill the image with data, so that the reads hit allocated blocks. */
+static int
+fill_image(MVHDMeta* vhdm, uint32_t num_sectors)
+{
+    uint8_t* buff;
+    uint32_t offset;
+    int i;
+
+    buff = malloc(256 * SECTOR_SIZE);
+    if (buff == NULL) {
+        return -1;
+    }
+    for (i = 0; i < 256 * SECTOR_SIZE; i++) {
+        buff[i] = (uint8_t)i;
+    }
+    for (offset = 0; offset < num_sectors; offset += 256) {
+        mvhd_write_sectors(vhdm, offset, 256, buff);
+    }
+    free(buff);
+
+    return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        char *help_text = 
+            "Expected args as follows:\n"
+            "minivhd_bench VHD_SPARSE [SIZE_MB] [SECONDS]\n"
+            "A dynamic VHD is created at VHD_SPARSE, filled, and read from at random\n"
+            "by 1, 2, 4, ... threads in turn, through one thread-safe handle.\n";
+        printf("%s\n", help_text);
+        return 1;
+    }
+    const char *vhd_path = argv[1];
+    int size_mb = (argc > 2) ? atoi(argv[2]) : 256;
+    double seconds = (argc > 3) ? atof(argv[3]) : 2.0;
+    MVHDCreationOptions create_opts;
+    MVHDOpenOptions open_opts;
+    Worker workers[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    volatile bool stop;
+    double start, elapsed, base_rate = 0.0, rate;
+    uint64_t reads;
+    uint32_t num_sectors;
+    int err, num_threads, i;
+
+    if (size_mb < 1) {
+        size_mb = 1;
+    }
+    num_sectors = (uint32_t)size_mb * ((1024 * 1024) / SECTOR_SIZE);
+
+    memset(&create_opts, 0, sizeof create_opts);
+    create_opts.type = MVHD_TYPE_DYNAMIC;
+    create_opts.path = (char*)vhd_path;
+    create_opts.size_in_bytes = (uint64_t)num_sectors * SECTOR_SIZE;
+    MVHDMeta *vhdm = mvhd_create_ex(create_opts, &err);
+    if (vhdm == NULL) {
+        printf("%s\n", mvhd_strerr(err));
+        return EXIT_FAILURE;
+    }
+    printf("Filling a %d MB dynamic VHD\n", size_mb);
+    if (fill_image(vhdm, num_sectors) != 0) {
+        printf("%s\n", mvhd_strerr(MVHD_ERR_MEM));
+        return EXIT_FAILURE;
+    }
+    mvhd_close(vhdm);
+
+    memset(&open_opts, 0, sizeof open_opts);
+    open_opts.readonly = 1;
+    open_opts.thread_safe = 1;
+    vhdm = mvhd_open_ex(vhd_path, open_opts, &err);
+    if (vhdm == NULL) {
+        printf("%s\n", mvhd_strerr(err));
+        return EXIT_FAILURE;
+    }
+
+    printf("threads      reads/s     MB/s  scaling\n");
+    for (num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+        stop = false;
+        for (i = 0; i < num_threads; i++) {
+            workers[i].vhdm = vhdm;
+            workers[i].num_sectors = num_sectors;
+            workers[i].seed = (unsigned)(i + 1);
+            workers[i].stop = &stop;
+            workers[i].reads = 0;
+        }
+
+        start = now();
+        for (i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+        }
+        while (now() - start < seconds) {
+            struct timespec ts = { 0, 10 * 1000 * 1000 };
+            nanosleep(&ts, NULL);
+        }
+        stop = true;
+
+        reads = 0;
+        for (i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+            reads += workers[i].reads;
+        }
+        elapsed = now() - start;
+
+        rate = reads / elapsed;
+        if (num_threads == 1) {
+            base_rate = rate;
+        }
+        printf("%7d %12.0f %8.1f %7.2fx\n", num_threads, rate,
+               rate * READ_SECTORS * SECTOR_SIZE / (1024.0 * 1024.0),
+               (base_rate > 0.0) ? rate / base_rate : 0.0);
+    }
+
+    mvhd_close(vhdm);
+
+    return EXIT_SUCCESS;
+}
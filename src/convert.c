@@ -88,7 +88,7 @@ mvhd_convert_to_vhd_fixed(const char* utf8_raw_path, const char* utf8_vhd_path,
     }    
 
     uint64_t size_in_bytes = mvhd_calc_size_bytes(&geom);
-    MVHDMeta *vhdm = mvhd_create_fixed_raw(utf8_vhd_path, raw_img, size_in_bytes, &geom, err, NULL);
+    MVHDMeta *vhdm = mvhd_create_fixed_raw(utf8_vhd_path, raw_img, size_in_bytes, &geom, err, NULL, NULL, NULL);
     if (vhdm == NULL) {
         return NULL;
     }
@@ -113,24 +113,31 @@ mvhd_convert_to_vhd_sparse(const char* utf8_raw_path, const char* utf8_vhd_path,
         goto end;
     }
 
-    uint8_t buff[4096] = {0}; // 8 sectors
-    uint8_t empty_buff[4096] = {0};
+    /* Go a whole block at a time, as that is what gets allocated or not */
+    uint8_t *buff = malloc((size_t)vhdm->sect_per_block * MVHD_SECTOR_SIZE);
+    if (buff == NULL) {
+        *err = MVHD_ERR_MEM;
+        mvhd_close(vhdm);
+        vhdm = NULL;
+        goto end;
+    }
     int total_sectors = mvhd_calc_size_sectors(&geom);
     int copy_sect = 0, i;
 
-    for (i = 0; i < total_sectors; i += 8) {
-        copy_sect = 8;
-        if ((i + 8) >= total_sectors) {
+    for (i = 0; i < total_sectors; i += copy_sect) {
+        copy_sect = vhdm->sect_per_block;
+        if ((i + copy_sect) >= total_sectors) {
             copy_sect = total_sectors - i;
-            memset(buff, 0, sizeof buff);
+            memset(buff, 0, (size_t)copy_sect * MVHD_SECTOR_SIZE);
         }
         fread(buff, MVHD_SECTOR_SIZE, copy_sect, raw_img);
 
         /* Only write data if there's data to write, to take advantage of the sparse VHD format */
-        if (memcmp(buff, empty_buff, sizeof buff) != 0) {
+        if (!mvhd_is_zero(buff, (size_t)copy_sect * MVHD_SECTOR_SIZE)) {
             mvhd_write_sectors(vhdm, i, copy_sect, buff);
         }
     }
+    free(buff);
 end:
     fclose(raw_img);
 
@@ -152,6 +159,8 @@ mvhd_convert_to_raw(const char* utf8_vhd_path, const char* utf8_raw_path, int *e
         return NULL;
     }
 
+    mvhd_file_hint(&vhdm->f, 0, 0, MVHD_HINT_SEQUENTIAL);
+
     uint8_t buff[4096] = {0}; // 8 sectors
     int total_sectors = mvhd_calc_size_sectors((MVHDGeom*)&vhdm->footer.geom);
     int copy_sect = 0, i;
@@ -168,3 +177,103 @@ mvhd_convert_to_raw(const char* utf8_vhd_path, const char* utf8_raw_path, int *e
 
     return raw_img;
 }
+
+
+bool
+mvhd_chain_has_data(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
+{
+    uint32_t blk, last;
+
+    for (; vhdm != NULL; vhdm = vhdm->parent) {
+        if (vhdm->footer.disk_type == MVHD_TYPE_FIXED) {
+            return true;
+        }
+        last = (offset + (uint32_t)num_sectors - 1) / (uint32_t)vhdm->sect_per_block;
+        for (blk = offset / (uint32_t)vhdm->sect_per_block; blk <= last && blk < vhdm->sparse.max_bat_ent; blk++) {
+            if (vhdm->block_offset[blk] != MVHD_SPARSE_BLK) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+MVHDAPI MVHDMeta *
+mvhd_flatten(const char* utf8_vhd_path, const char* utf8_out_path, int* err)
+{
+    MVHDCreationOptions options;
+    MVHDMeta *vhdm, *out;
+    uint8_t *buff;
+
+    vhdm = mvhd_open(utf8_vhd_path, true, err);
+    if (vhdm == NULL) {
+        return NULL;
+    }
+    mvhd_file_hint(&vhdm->f, 0, 0, MVHD_HINT_SEQUENTIAL);
+
+    /* The copy gets the geometry and size of the original, and its block size if it has one */
+    memset(&options, 0, sizeof options);
+    options.type = MVHD_TYPE_DYNAMIC;
+    options.path = (char*)utf8_out_path;
+    options.size_in_bytes = vhdm->footer.curr_sz;
+    options.geometry.cyl = vhdm->footer.geom.cyl;
+    options.geometry.heads = vhdm->footer.geom.heads;
+    options.geometry.spt = vhdm->footer.geom.spt;
+    if (vhdm->footer.disk_type != MVHD_TYPE_FIXED) {
+        options.block_size_in_sectors = (uint32_t)vhdm->sect_per_block;
+    } else {
+        options.block_size_in_sectors = MVHD_BLOCK_LARGE;
+    }
+    out = mvhd_create_ex(options, err);
+    if (out == NULL) {
+        goto end;
+    }
+
+    buff = malloc((size_t)out->sect_per_block * MVHD_SECTOR_SIZE);
+    if (buff == NULL) {
+        *err = MVHD_ERR_MEM;
+        goto cleanup_out;
+    }
+
+    /**
+     * Go through the chain a block of the new image at a time. Blocks that are
+     * not allocated in any of the images read as zeros, so they can be skipped 
+     * without reading them, and blocks which turn out to be all zeros are not
+     * written either.
+     */
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    uint32_t s;
+    int copy_sect;
+
+    for (s = 0; s < total_sectors; s += (uint32_t)copy_sect) {
+        copy_sect = out->sect_per_block;
+        if (total_sectors - s < (uint32_t)copy_sect) {
+            copy_sect = (int)(total_sectors - s);
+        }
+        if (!mvhd_chain_has_data(vhdm, s, copy_sect)) {
+            continue;
+        }
+        mvhd_read_sectors(vhdm, s, copy_sect, buff);
+        if (mvhd_is_zero(buff, (size_t)copy_sect * MVHD_SECTOR_SIZE)) {
+            continue;
+        }
+        if (mvhd_write_sectors(out, s, copy_sect, buff) != 0) {
+            *err = MVHD_ERR_FILE;
+            free(buff);
+            goto cleanup_out;
+        }
+    }
+    free(buff);
+    goto end;
+
+cleanup_out:
+    mvhd_close(out);
+    out = NULL;
+
+end:
+    mvhd_close(vhdm);
+
+    return out;
+}
@@ -216,7 +216,7 @@ mvhd_create_fixed(const char* path, MVHDGeom geom, int* err, mvhd_progress_callb
 {
     uint64_t size_in_bytes = mvhd_calc_size_bytes(&geom);
 
-    return mvhd_create_fixed_raw(path, NULL, size_in_bytes, &geom, err, progress_callback);
+    return mvhd_create_fixed_raw(path, NULL, size_in_bytes, &geom, err, progress_callback, NULL, NULL);
 }
 
 
@@ -227,12 +227,16 @@ mvhd_create_fixed(const char* path, MVHDGeom geom, int* err, mvhd_progress_callb
  * raw disk image as the data source for the new fixed VHD.
  * 
  * \param [in] raw_image file handle to a raw disk image to populate VHD
+ * \param [in] io_ops storage backend to create the VHD with, or NULL for regular files
+ * \param [in] io_user user data for the storage backend
  */
 MVHDMeta *
-mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, MVHDGeom* geom, int* err, mvhd_progress_callback progress_callback)
+mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, MVHDGeom* geom, int* err, mvhd_progress_callback progress_callback, const MVHDIOOps* io_ops, void* io_user)
 { 
-    uint8_t img_data[MVHD_SECTOR_SIZE] = {0};
+    uint8_t img_data[MVHD_SECTOR_SIZE * 64] = {0};
     uint8_t footer_buff[MVHD_FOOTER_SIZE] = {0};
+    MVHDOpenOptions options;
+    MVHDFile f;
 
     if (geom == NULL || (geom->cyl == 0 || geom->heads == 0 || geom->spt == 0)) {
         *err = MVHD_ERR_INVALID_GEOM;
@@ -245,14 +249,13 @@ mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, M
         goto end;
     }
 
-    FILE* f = mvhd_fopen(path, "wb+", err);
-    if (f == NULL) {
+    if (mvhd_file_open(&f, io_ops, io_user, path, "wb+", err) < 0) {
         goto cleanup_vhdm;
     }
-    mvhd_fseeko64(f, 0, SEEK_SET);
+    mvhd_file_hint(&f, 0, 0, MVHD_HINT_SEQUENTIAL);
 
     uint32_t size_sectors = (uint32_t)(size_in_bytes / MVHD_SECTOR_SIZE);
-    uint32_t s;
+    uint32_t s, n;
 
     if (progress_callback)
         progress_callback(0, size_sectors);
@@ -263,32 +266,40 @@ mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, M
         MVHDGeom raw_geom = mvhd_calculate_geometry(raw_size);
         if (mvhd_calc_size_bytes(&raw_geom) != raw_size) {
             *err = MVHD_ERR_CONV_SIZE;
-            goto cleanup_vhdm;
+            goto cleanup_file;
         }
         gen_footer(&vhdm->footer, raw_size, geom, MVHD_TYPE_FIXED, 0);        
         mvhd_fseeko64(raw_img, 0, SEEK_SET);
-        for (s = 0; s < size_sectors; s++) {            
-            fread(img_data, sizeof img_data, 1, raw_img);
-            fwrite(img_data, sizeof img_data, 1, f);
-            if (progress_callback)
-                progress_callback(s + 1, size_sectors);
-        }
     } else {
         gen_footer(&vhdm->footer, size_in_bytes, geom, MVHD_TYPE_FIXED, 0);        
-        for (s = 0; s < size_sectors; s++) {            
-            fwrite(img_data, sizeof img_data, 1, f);
-            if (progress_callback)
-                progress_callback(s + 1, size_sectors);
+    }
+
+    /* Copy (or zero) the data area a chunk at a time */
+    for (s = 0; s < size_sectors; s += n) {            
+        n = size_sectors - s;
+        if (n > sizeof img_data / MVHD_SECTOR_SIZE) {
+            n = sizeof img_data / MVHD_SECTOR_SIZE;
+        }
+        if (raw_img != NULL) {
+            fread(img_data, MVHD_SECTOR_SIZE, n, raw_img);
         }
+        mvhd_write_at(&f, img_data, (size_t)n * MVHD_SECTOR_SIZE, (uint64_t)s * MVHD_SECTOR_SIZE);
+        if (progress_callback)
+            progress_callback(s + n, size_sectors);
     }
     mvhd_footer_to_buffer(&vhdm->footer, footer_buff);
-    fwrite(footer_buff, sizeof footer_buff, 1, f);
-    fclose(f);
-    f = NULL;
+    mvhd_write_at(&f, footer_buff, sizeof footer_buff, (uint64_t)size_sectors * MVHD_SECTOR_SIZE);
+    mvhd_file_close(&f);
     free(vhdm);
-    vhdm = mvhd_open(path, false, err);
+    memset(&options, 0, sizeof options);
+    options.io_ops = io_ops;
+    options.io_user = io_user;
+    vhdm = mvhd_open_ex(path, options, err);
     goto end;
 
+cleanup_file:
+    mvhd_file_close(&f);
+
 cleanup_vhdm:
     free(vhdm);
     vhdm = NULL;
@@ -307,11 +318,13 @@ end:
  * \param [in] geom is the HDD geometry of the image to create. Determines final image size
  * \param [in] block_size_in_sectors is the block size in sectors
  * \param [out] err indicates what error occurred, if any
+ * \param [in] io_ops storage backend to create the VHD with (and open the parent), or NULL for regular files
+ * \param [in] io_user user data for the storage backend
  * 
  * \return NULL if an error occurrs. Check value of *err for actual error. Otherwise returns pointer to a MVHDMeta struct
  */
 static MVHDMeta *
-create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_bytes, MVHDGeom* geom, uint32_t block_size_in_sectors, int* err)
+create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_bytes, MVHDGeom* geom, uint32_t block_size_in_sectors, int* err, const MVHDIOOps* io_ops, void* io_user)
 {
     uint8_t footer_buff[MVHD_FOOTER_SIZE] = {0};
     uint8_t sparse_buff[MVHD_SPARSE_SIZE] = {0};
@@ -323,13 +336,22 @@ create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_byte
     mvhd_utf16* w2ku_path_buff = NULL;
     mvhd_utf16* w2ru_path_buff = NULL;
     uint32_t par_mod_timestamp = 0;
+    MVHDOpenOptions options;
+    MVHDFile f;
 
     if (par_path != NULL) {
-        par_mod_timestamp = mvhd_file_mod_timestamp(par_path, err);
-        if (*err != 0) {
-            goto end;
+        /* Only regular files have a last-modified timestamp to record */
+        if (io_ops == NULL || io_ops == mvhd_default_io_ops()) {
+            par_mod_timestamp = mvhd_file_mod_timestamp(par_path, err);
+            if (*err != 0) {
+                goto end;
+            }
         }
-        par_vhdm = mvhd_open(par_path, true, err);
+        memset(&options, 0, sizeof options);
+        options.readonly = 1;
+        options.io_ops = io_ops;
+        options.io_user = io_user;
+        par_vhdm = mvhd_open_ex(par_path, options, err);
         if (par_vhdm == NULL) {
             goto end;
         }
@@ -352,11 +374,9 @@ create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_byte
         goto cleanup_vhdm;
     } 
     
-    FILE* f = mvhd_fopen(path, "wb+", err);
-    if (f == NULL) {
+    if (mvhd_file_open(&f, io_ops, io_user, path, "wb+", err) < 0) {
         goto cleanup_vhdm;
     }
-    mvhd_fseeko64(f, 0, SEEK_SET);
 
     /* Note, the sparse header follows the footer copy at the beginning of the file */
     if (par_path == NULL) {
@@ -367,7 +387,7 @@ create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_byte
     mvhd_footer_to_buffer(&vhdm->footer, footer_buff);
 
     /* As mentioned, start with a copy of the footer */
-    fwrite(footer_buff, sizeof footer_buff, 1, f);
+    mvhd_write_at(&f, footer_buff, sizeof footer_buff, 0);
 
     /**
      * Calculate the number of (2MB or 512KB) data blocks required to store the entire
@@ -417,53 +437,52 @@ create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_byte
     }
     gen_sparse_header(&vhdm->sparse, num_blks, bat_offset, block_size_in_sectors);
     mvhd_header_to_buffer(&vhdm->sparse, sparse_buff);
-    fwrite(sparse_buff, sizeof sparse_buff, 1, f);
+    mvhd_write_at(&f, sparse_buff, sizeof sparse_buff, MVHD_FOOTER_SIZE);
 
     /* The BAT sectors need to be filled with 0xffffffff */
+    uint64_t curr_pos = bat_offset;
     uint32_t k;
     for (k = 0; k < num_bat_sect; k++) {
-        fwrite(bat_sect, sizeof bat_sect, 1, f);
+        mvhd_write_at(&f, bat_sect, sizeof bat_sect, curr_pos);
+        curr_pos += sizeof bat_sect;
     }
-    mvhd_write_empty_sectors(f, 5);
+    mvhd_write_empty_sectors(&f, curr_pos, 5);
+    curr_pos += 5 * MVHD_SECTOR_SIZE;
 
     /**
      * If creating a differencing VHD, the paths to the parent image need to be written
      * tp the file. Both absolute and relative paths are written 
      * */
     if (par_vhdm != NULL) {
-        uint64_t curr_pos = (uint64_t)mvhd_ftello64(f);
-
         /* Double check my sums... */
         assert(curr_pos == par_loc_offset);
 
         /* Fill the space required for location data with zero */
-        uint8_t empty_sect[MVHD_SECTOR_SIZE] = {0};
         int i;
-        uint32_t j;
 
         for (i = 0; i < 2; i++) {
-            for (j = 0; j < (vhdm->sparse.par_loc_entry[i].plat_data_space / MVHD_SECTOR_SIZE); j++) {
-                fwrite(empty_sect, sizeof empty_sect, 1, f);
-            }
+            mvhd_write_empty_sectors(&f, curr_pos, (int)(vhdm->sparse.par_loc_entry[i].plat_data_space / MVHD_SECTOR_SIZE));
+            curr_pos += vhdm->sparse.par_loc_entry[i].plat_data_space;
         }
 
         /* Now write the location entries */
-        mvhd_fseeko64(f, vhdm->sparse.par_loc_entry[0].plat_data_offset, SEEK_SET);
-        fwrite(w2ku_path_buff, vhdm->sparse.par_loc_entry[0].plat_data_len, 1, f);
-        mvhd_fseeko64(f, vhdm->sparse.par_loc_entry[1].plat_data_offset, SEEK_SET);
-        fwrite(w2ru_path_buff, vhdm->sparse.par_loc_entry[1].plat_data_len, 1, f);
+        mvhd_write_at(&f, w2ku_path_buff, vhdm->sparse.par_loc_entry[0].plat_data_len, vhdm->sparse.par_loc_entry[0].plat_data_offset);
+        mvhd_write_at(&f, w2ru_path_buff, vhdm->sparse.par_loc_entry[1].plat_data_len, vhdm->sparse.par_loc_entry[1].plat_data_offset);
 
-        /* and reset the file position to continue */
-        mvhd_fseeko64(f, vhdm->sparse.par_loc_entry[1].plat_data_offset + vhdm->sparse.par_loc_entry[1].plat_data_space, SEEK_SET);
-        mvhd_write_empty_sectors(f, 5);
+        /* and continue after the last locator */
+        curr_pos = vhdm->sparse.par_loc_entry[1].plat_data_offset + vhdm->sparse.par_loc_entry[1].plat_data_space;
+        mvhd_write_empty_sectors(&f, curr_pos, 5);
+        curr_pos += 5 * MVHD_SECTOR_SIZE;
     }
 
     /* And finish with the footer */
-    fwrite(footer_buff, sizeof footer_buff, 1, f);
-    fclose(f);
-    f = NULL;
+    mvhd_write_at(&f, footer_buff, sizeof footer_buff, curr_pos);
+    mvhd_file_close(&f);
     free(vhdm);
-    vhdm = mvhd_open(path, false, err);
+    memset(&options, 0, sizeof options);
+    options.io_ops = io_ops;
+    options.io_user = io_user;
+    vhdm = mvhd_open_ex(path, options, err);
     goto end;
 
 cleanup_vhdm:
@@ -488,14 +507,14 @@ mvhd_create_sparse(const char* path, MVHDGeom geom, int* err)
 {
     uint64_t size_in_bytes = mvhd_calc_size_bytes(&geom);
 
-    return create_sparse_diff(path, NULL, size_in_bytes, &geom, MVHD_BLOCK_LARGE, err);
+    return create_sparse_diff(path, NULL, size_in_bytes, &geom, MVHD_BLOCK_LARGE, err, NULL, NULL);
 }
 
 
 MVHDAPI MVHDMeta *
 mvhd_create_diff(const char* path, const char* par_path, int* err)
 {
-    return create_sparse_diff(path, par_path, 0, NULL, MVHD_BLOCK_LARGE, err);
+    return create_sparse_diff(path, par_path, 0, NULL, MVHD_BLOCK_LARGE, err, NULL, NULL);
 }
 
 
@@ -556,19 +575,510 @@ mvhd_create_ex(MVHDCreationOptions options, int* err)
 
     switch (options.type) {
 	case MVHD_TYPE_FIXED:
-		return mvhd_create_fixed_raw(options.path, NULL, options.size_in_bytes, &(options.geometry), err, options.progress_callback);
+		return mvhd_create_fixed_raw(options.path, NULL, options.size_in_bytes, &(options.geometry), err, options.progress_callback, options.io_ops, options.io_user);
 
 	case MVHD_TYPE_DYNAMIC:
-		return create_sparse_diff(options.path, NULL, options.size_in_bytes, &(options.geometry), options.block_size_in_sectors, err);
+		return create_sparse_diff(options.path, NULL, options.size_in_bytes, &(options.geometry), options.block_size_in_sectors, err, options.io_ops, options.io_user);
 
 	case MVHD_TYPE_DIFF:
-		return create_sparse_diff(options.path, options.parent_path, 0, NULL, options.block_size_in_sectors, err);
+		return create_sparse_diff(options.path, options.parent_path, 0, NULL, options.block_size_in_sectors, err, options.io_ops, options.io_user);
     }
 
     return NULL; /* Make the compiler happy */
 }
 
 
+/**
+ * \brief Clear the sectors of a block that are not marked present, and check if it holds any data
+ * 
+ * Sectors that are not present may contain anything, for example left overs of a block
+ * that was freed before. In a dynamic image, a block holding only zeros reads the same as
+ * an unallocated block. In a differencing image those zeros hide the data of the parent,
+ * so the block has to stay.
+ * 
+ * \param [in] vhdm is the image the block was read from
+ * \param [in] buff holds the sector bitmap of the block, followed by its data
+ * 
+ * \retval true if the block has to be kept
+ */
+static bool
+scrub_block(MVHDMeta* vhdm, uint8_t* buff)
+{
+    uint8_t* data = buff + ((size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+    bool present = false;
+    int s;
+
+    for (s = 0; s < vhdm->sect_per_block; s++) {
+        if (VHD_TESTBIT(buff, s)) {
+            present = true;
+        } else {
+            memset(data + ((size_t)s * MVHD_SECTOR_SIZE), 0, MVHD_SECTOR_SIZE);
+        }
+    }
+    if (!present) {
+        return false;
+    }
+    if (vhdm->footer.disk_type == MVHD_TYPE_DYNAMIC) {
+        return !mvhd_is_zero(data, (size_t)vhdm->sect_per_block * MVHD_SECTOR_SIZE);
+    }
+
+    return true;
+}
+
+
+MVHDAPI MVHDMeta *
+mvhd_compact(const char* path, const char* out_path, int* err)
+{
+    uint8_t footer_buff[MVHD_FOOTER_SIZE] = {0};
+    uint8_t sparse_buff[MVHD_SPARSE_SIZE] = {0};
+    MVHDFooter footer;
+    MVHDSparseHeader sparse;
+    MVHDGeom geom;
+    MVHDMeta* src;
+    MVHDMeta* vhdm = NULL;
+    uint32_t* bat = NULL;
+    uint8_t* blk_buff = NULL;
+    mvhd_utf16* w2ku_path_buff = NULL;
+    mvhd_utf16* w2ru_path_buff = NULL;
+    MVHDOpenOptions options;
+    MVHDFile f;
+    int i;
+
+    if (path == NULL || out_path == NULL || strcmp(path, out_path) == 0) {
+        *err = MVHD_ERR_INVALID_PARAMS;
+        return NULL;
+    }
+
+    memset(&options, 0, sizeof options);
+    options.readonly = 1;
+    src = mvhd_open_ex(path, options, err);
+    if (src == NULL) {
+        return NULL;
+    }
+    if (src->footer.disk_type == MVHD_TYPE_FIXED) {
+        *err = MVHD_ERR_TYPE;
+        goto cleanup_src;
+    }
+
+    uint32_t num_blks = src->sparse.max_bat_ent;
+    uint32_t num_bat_sect = num_blks / MVHD_BAT_ENT_PER_SECT;
+    if (num_blks % MVHD_BAT_ENT_PER_SECT != 0) {
+        num_bat_sect += 1;
+    }
+    size_t blk_size = (size_t)(src->bitmap.sector_count + src->sect_per_block) * MVHD_SECTOR_SIZE;
+
+    bat = malloc((size_t)num_bat_sect * MVHD_SECTOR_SIZE);
+    blk_buff = malloc(blk_size);
+    if (bat == NULL || blk_buff == NULL) {
+        *err = MVHD_ERR_MEM;
+        goto cleanup_buffs;
+    }
+    memset(bat, 0xff, (size_t)num_bat_sect * MVHD_SECTOR_SIZE);
+
+    /* The image keeps its identity, so differencing images made from it stay valid */
+    geom.cyl = src->footer.geom.cyl;
+    geom.heads = src->footer.geom.heads;
+    geom.spt = src->footer.geom.spt;
+    gen_footer(&footer, src->footer.curr_sz, &geom, (MVHDType)src->footer.disk_type, MVHD_FOOTER_SIZE);
+    memcpy(footer.uuid, src->footer.uuid, sizeof footer.uuid);
+    footer.orig_sz = src->footer.orig_sz;
+    footer.checksum = mvhd_gen_footer_checksum(&footer);
+    mvhd_footer_to_buffer(&footer, footer_buff);
+
+    /* Same layout as a newly created image, see create_sparse_diff() */
+    memset(&sparse, 0, sizeof sparse);
+    uint64_t bat_offset = MVHD_FOOTER_SIZE + MVHD_SPARSE_SIZE;
+    uint64_t curr_pos = bat_offset + ((uint64_t)num_bat_sect * MVHD_SECTOR_SIZE) + (5 * MVHD_SECTOR_SIZE);
+
+    if (src->footer.disk_type == MVHD_TYPE_DIFF) {
+        w2ku_path_buff = calloc(MVHD_MAX_PATH_CHARS, sizeof * w2ku_path_buff);
+        w2ru_path_buff = calloc(MVHD_MAX_PATH_CHARS, sizeof * w2ru_path_buff);
+        if (w2ku_path_buff == NULL || w2ru_path_buff == NULL) {
+            *err = MVHD_ERR_MEM;
+            goto cleanup_buffs;
+        }
+        memcpy(sparse.par_uuid, src->sparse.par_uuid, sizeof sparse.par_uuid);
+        sparse.par_timestamp = src->sparse.par_timestamp;
+
+        /* The relative path to the parent has to be worked out again for the new location */
+        if (gen_par_loc(&sparse, out_path, src->parent->filename, curr_pos, w2ku_path_buff, w2ru_path_buff, (MVHDError*)err) < 0) {
+            goto cleanup_buffs;
+        }
+    }
+    gen_sparse_header(&sparse, num_blks, bat_offset, (uint32_t)src->sect_per_block);
+    mvhd_header_to_buffer(&sparse, sparse_buff);
+
+    if (mvhd_file_open(&f, NULL, NULL, out_path, "wb+", err) < 0) {
+        goto cleanup_buffs;
+    }
+    mvhd_file_hint(&f, 0, 0, MVHD_HINT_SEQUENTIAL);
+
+    mvhd_write_at(&f, footer_buff, sizeof footer_buff, 0);
+    mvhd_write_at(&f, sparse_buff, sizeof sparse_buff, MVHD_FOOTER_SIZE);
+    mvhd_write_empty_sectors(&f, bat_offset + ((uint64_t)num_bat_sect * MVHD_SECTOR_SIZE), 5);
+
+    if (src->footer.disk_type == MVHD_TYPE_DIFF) {
+        for (i = 0; i < 2; i++) {
+            mvhd_write_empty_sectors(&f, curr_pos, (int)(sparse.par_loc_entry[i].plat_data_space / MVHD_SECTOR_SIZE));
+            curr_pos += sparse.par_loc_entry[i].plat_data_space;
+        }
+        mvhd_write_at(&f, w2ku_path_buff, sparse.par_loc_entry[0].plat_data_len, sparse.par_loc_entry[0].plat_data_offset);
+        mvhd_write_at(&f, w2ru_path_buff, sparse.par_loc_entry[1].plat_data_len, sparse.par_loc_entry[1].plat_data_offset);
+        mvhd_write_empty_sectors(&f, curr_pos, 5);
+        curr_pos += 5 * MVHD_SECTOR_SIZE;
+    }
+
+    /**
+     * Copy the blocks that hold data in the order of the disk, rather than
+     * the order they were allocated in, so that sequential reads of the
+     * disk are sequential in the file too.
+     */
+    uint32_t blk;
+    for (blk = 0; blk < num_blks; blk++) {
+        if (src->block_offset[blk] == MVHD_SPARSE_BLK) {
+            continue;
+        }
+        if (mvhd_read_at(&src->f, blk_buff, blk_size, (uint64_t)src->block_offset[blk] * MVHD_SECTOR_SIZE) != 0) {
+            *err = MVHD_ERR_FILE;
+            goto cleanup_file;
+        }
+        if (!scrub_block(src, blk_buff)) {
+            continue;
+        }
+        if (mvhd_write_at(&f, blk_buff, blk_size, curr_pos) != 0) {
+            *err = MVHD_ERR_FILE;
+            goto cleanup_file;
+        }
+        bat[blk] = mvhd_to_be32((uint32_t)(curr_pos / MVHD_SECTOR_SIZE));
+        curr_pos += blk_size;
+    }
+
+    mvhd_write_at(&f, bat, (size_t)num_bat_sect * MVHD_SECTOR_SIZE, bat_offset);
+    if (mvhd_write_at(&f, footer_buff, sizeof footer_buff, curr_pos) != 0 || mvhd_file_flush(&f) != 0) {
+        *err = MVHD_ERR_FILE;
+        goto cleanup_file;
+    }
+    mvhd_file_close(&f);
+    mvhd_close(src);
+    src = NULL;
+
+    memset(&options, 0, sizeof options);
+    vhdm = mvhd_open_ex(out_path, options, err);
+    goto cleanup_buffs;
+
+cleanup_file:
+    mvhd_file_close(&f);
+
+cleanup_buffs:
+    free(w2ku_path_buff);
+    free(w2ru_path_buff);
+    free(blk_buff);
+    free(bat);
+
+cleanup_src:
+    if (src != NULL) {
+        mvhd_close(src);
+    }
+
+    return vhdm;
+}
+
+
+/**
+ * \brief Check if a sector the child does not hold reads differently on the new parent
+ */
+static inline bool
+sector_differs(const uint8_t* bitmap, const uint8_t* old_data, const uint8_t* new_data, int k)
+{
+    if (VHD_TESTBIT(bitmap, k)) {
+        return false;
+    }
+
+    return memcmp(old_data + ((size_t)k * MVHD_SECTOR_SIZE), new_data + ((size_t)k * MVHD_SECTOR_SIZE), MVHD_SECTOR_SIZE) != 0;
+}
+
+
+/**
+ * \brief Copy the sectors of a block that would read differently on a new parent
+ * 
+ * Only the sectors the child does not hold itself are compared, and where the 
+ * new parent differs, the data of the old parent is written to the child.
+ * 
+ * \param [in] vhdm differencing image, with its new parent already in place
+ * \param [in] old_par the parent being replaced
+ * \param [in] blk block number
+ * \param [in] bitmap buffer for the sector bitmap of a block
+ * \param [in] old_data buffer for the data of a block in the old parent
+ * \param [in] new_data buffer for the data of a block in the new parent
+ * 
+ * \return 0 if successful, an MVHDError otherwise
+ */
+static int
+rebase_block(MVHDMeta* vhdm, MVHDMeta* old_par, uint32_t blk, uint8_t* bitmap, uint8_t* old_data, uint8_t* new_data)
+{
+    size_t bm_size = (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE;
+    uint32_t first = blk * (uint32_t)vhdm->sect_per_block;
+    uint32_t total = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    int n = vhdm->sect_per_block;
+    bool old_has, new_has;
+    int s, e;
+
+    if (first + (uint32_t)n > total) {
+        n = (int)(total - first);
+    }
+
+    /* The BATs tell us first if both parents read as zeros here */
+    old_has = mvhd_chain_has_data(old_par, first, n);
+    new_has = mvhd_chain_has_data(vhdm->parent, first, n);
+    if (!old_has && !new_has) {
+        return 0;
+    }
+
+    if (vhdm->block_offset[blk] == MVHD_SPARSE_BLK) {
+        memset(bitmap, 0, bm_size);
+    } else if (mvhd_read_at(&vhdm->f, bitmap, bm_size, (uint64_t)vhdm->block_offset[blk] * MVHD_SECTOR_SIZE) != 0) {
+        return MVHD_ERR_FILE;
+    }
+
+    if (old_has) {
+        mvhd_read_sectors(old_par, first, n, old_data);
+    } else {
+        memset(old_data, 0, (size_t)n * MVHD_SECTOR_SIZE);
+    }
+    if (new_has) {
+        mvhd_read_sectors(vhdm->parent, first, n, new_data);
+    } else {
+        memset(new_data, 0, (size_t)n * MVHD_SECTOR_SIZE);
+    }
+
+    for (s = 0; s < n; s = e) {
+        e = s + 1;
+        if (!sector_differs(bitmap, old_data, new_data, s)) {
+            continue;
+        }
+        while (e < n && sector_differs(bitmap, old_data, new_data, e)) {
+            e++;
+        }
+        if (mvhd_write_sectors(vhdm, first + (uint32_t)s, e - s, old_data + ((size_t)s * MVHD_SECTOR_SIZE)) != 0) {
+            return MVHD_ERR_FILE;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * \brief Point the sparse header of a differencing image at a new parent
+ * 
+ * The new parent locators go where the old ones were, if they fit. Otherwise
+ * they are put at the end of the file, before the footer.
+ * 
+ * \param [in] vhdm differencing image
+ * \param [in] par_path path to the new parent
+ * \param [in] par_uuid UUID of the new parent
+ * \param [in] par_timestamp last modified timestamp of the new parent
+ * \param [out] err indicates what error occurred, if any
+ * 
+ * \retval 0 if success
+ * \retval < 0 if an error occurrs. Check value of *err for actual error
+ */
+static int
+rebase_header(MVHDMeta* vhdm, const char* par_path, const uint8_t* par_uuid, uint32_t par_timestamp, int* err)
+{
+    uint8_t footer_buff[MVHD_FOOTER_SIZE];
+    uint8_t sparse_buff[MVHD_SPARSE_SIZE];
+    MVHDSparseHeader sparse = vhdm->sparse;
+    mvhd_utf16* w2ku_path_buff;
+    mvhd_utf16* w2ru_path_buff;
+    uint64_t start, avail, need;
+    int64_t end = vhdm->footer_pos;
+    int i, rv = -1;
+
+    w2ku_path_buff = calloc(MVHD_MAX_PATH_CHARS, sizeof * w2ku_path_buff);
+    w2ru_path_buff = calloc(MVHD_MAX_PATH_CHARS, sizeof * w2ru_path_buff);
+    if (w2ku_path_buff == NULL || w2ru_path_buff == NULL) {
+        *err = MVHD_ERR_MEM;
+        goto end;
+    }
+
+    /* The space of the first two locators, as create_sparse_diff() lays them out */
+    start = sparse.par_loc_entry[0].plat_data_offset;
+    avail = 0;
+    if (sparse.par_loc_entry[0].plat_code != 0) {
+        avail = mvhd_par_loc_bytes(&sparse, 0);
+        if (sparse.par_loc_entry[1].plat_code != 0 && sparse.par_loc_entry[1].plat_data_offset == start + avail) {
+            avail += mvhd_par_loc_bytes(&sparse, 1);
+        }
+    }
+
+    /* Any locators for other platforms would still point at the old parent */
+    memset(sparse.par_utf16_name, 0, sizeof sparse.par_utf16_name);
+    memset(sparse.par_loc_entry, 0, sizeof sparse.par_loc_entry);
+    memcpy(sparse.par_uuid, par_uuid, sizeof sparse.par_uuid);
+    sparse.par_timestamp = par_timestamp;
+    if (gen_par_loc(&sparse, vhdm->filename, par_path, start, w2ku_path_buff, w2ru_path_buff, (MVHDError*)err) < 0) {
+        goto end;
+    }
+
+    need = (uint64_t)sparse.par_loc_entry[0].plat_data_space + sparse.par_loc_entry[1].plat_data_space;
+    if (need > avail) {
+        if (end % MVHD_SECTOR_SIZE != 0) {
+            end += (int64_t)MVHD_SECTOR_SIZE - (end % MVHD_SECTOR_SIZE);
+        }
+        sparse.par_loc_entry[0].plat_data_offset = (uint64_t)end;
+        sparse.par_loc_entry[1].plat_data_offset = (uint64_t)end + sparse.par_loc_entry[0].plat_data_space;
+        end += (int64_t)need;
+    }
+
+    for (i = 0; i < 2; i++) {
+        mvhd_write_empty_sectors(&vhdm->f, sparse.par_loc_entry[i].plat_data_offset, (int)(sparse.par_loc_entry[i].plat_data_space / MVHD_SECTOR_SIZE));
+    }
+    mvhd_write_at(&vhdm->f, w2ku_path_buff, sparse.par_loc_entry[0].plat_data_len, sparse.par_loc_entry[0].plat_data_offset);
+    mvhd_write_at(&vhdm->f, w2ru_path_buff, sparse.par_loc_entry[1].plat_data_len, sparse.par_loc_entry[1].plat_data_offset);
+    if (end != vhdm->footer_pos) {
+        mvhd_footer_to_buffer(&vhdm->footer, footer_buff);
+        if (mvhd_write_at(&vhdm->f, footer_buff, sizeof footer_buff, (uint64_t)end) != 0) {
+            *err = MVHD_ERR_FILE;
+            goto end;
+        }
+        vhdm->footer_pos = end;
+    }
+
+    /* Only now that everything it points at is in place, the header itself */
+    sparse.checksum = mvhd_gen_sparse_checksum(&sparse);
+    mvhd_header_to_buffer(&sparse, sparse_buff);
+    if (mvhd_write_at(&vhdm->f, sparse_buff, sizeof sparse_buff, vhdm->footer.data_offset) != 0) {
+        *err = MVHD_ERR_FILE;
+        goto end;
+    }
+    vhdm->sparse = sparse;
+    rv = 0;
+
+end:
+    free(w2ku_path_buff);
+    free(w2ru_path_buff);
+
+    return rv;
+}
+
+
+MVHDAPI int
+mvhd_diff_rebase(MVHDMeta* vhdm, const char* par_path, int* err)
+{
+    MVHDOpenOptions options;
+    MVHDMeta* old_par;
+    MVHDMeta* new_par;
+    uint8_t* bitmap = NULL;
+    uint8_t* old_data = NULL;
+    uint8_t* new_data = NULL;
+    uint32_t par_timestamp = 0;
+    uint32_t blk;
+    bool had_map;
+    int ret = 0;
+
+    if (vhdm == NULL || par_path == NULL || err == NULL) {
+        if (err != NULL)
+            *err = MVHD_ERR_INVALID_PARAMS;
+        return -1;
+    }
+    if (vhdm->footer.disk_type != MVHD_TYPE_DIFF) {
+        *err = MVHD_ERR_TYPE;
+        return -1;
+    }
+    if (vhdm->readonly) {
+        *err = MVHD_ERR_INVALID_PARAMS;
+        return -1;
+    }
+
+    /* The sector bitmaps are read from the file, so write back any cached ones */
+    if (mvhd_flush(vhdm) != 0) {
+        *err = MVHD_ERR_FILE;
+        return -1;
+    }
+
+    /* Only regular files have a last-modified timestamp to record */
+    if (vhdm->f.ops == mvhd_default_io_ops()) {
+        par_timestamp = mvhd_file_mod_timestamp(par_path, err);
+        if (*err != 0) {
+            return -1;
+        }
+    }
+
+    memset(&options, 0, sizeof options);
+    options.readonly = 1;
+    options.io_ops = vhdm->f.ops;
+    options.io_user = vhdm->f.user;
+    options.thread_safe = vhdm->locks != NULL;
+    new_par = mvhd_open_ex(par_path, options, err);
+    if (new_par == NULL) {
+        return -1;
+    }
+    *err = 0;
+    if (new_par->footer.curr_sz != vhdm->footer.curr_sz) {
+        *err = MVHD_ERR_INVALID_SIZE;
+        mvhd_close(new_par);
+        return -1;
+    }
+
+    bitmap = malloc((size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+    old_data = malloc((size_t)vhdm->sect_per_block * MVHD_SECTOR_SIZE);
+    new_data = malloc((size_t)vhdm->sect_per_block * MVHD_SECTOR_SIZE);
+    if (bitmap == NULL || old_data == NULL || new_data == NULL) {
+        *err = MVHD_ERR_MEM;
+        mvhd_close(new_par);
+        ret = -1;
+        goto end;
+    }
+
+    /**
+     * Writes to the child have to see the new parent already, or zeros that
+     * only the new parent needs would not be written. The owner map is of no
+     * use with two parents, so it is made again afterwards.
+     */
+    had_map = vhdm->owner_map != NULL;
+    mvhd_owner_map_free(vhdm);
+    old_par = vhdm->parent;
+    vhdm->parent = new_par;
+
+    for (blk = 0; blk < vhdm->sparse.max_bat_ent; blk++) {
+        ret = rebase_block(vhdm, old_par, blk, bitmap, old_data, new_data);
+        if (ret != 0) {
+            break;
+        }
+    }
+    if (ret == 0 && mvhd_flush(vhdm) != 0) {
+        ret = MVHD_ERR_FILE;
+    }
+    if (ret != 0) {
+        /* What was copied so far reads the same on the old parent */
+        *err = ret;
+        ret = -1;
+        vhdm->parent = old_par;
+        mvhd_close(new_par);
+    } else {
+        ret = rebase_header(vhdm, par_path, new_par->footer.uuid, par_timestamp, err);
+        if (ret == 0) {
+            mvhd_close(old_par);
+        } else {
+            vhdm->parent = old_par;
+            mvhd_close(new_par);
+        }
+    }
+    if (had_map && mvhd_owner_map_init(vhdm) == -1 && ret == 0) {
+        *err = MVHD_ERR_MEM;
+        ret = -1;
+    }
+
+end:
+    free(bitmap);
+    free(old_data);
+    free(new_data);
+
+    return ret;
+}
+
+
 bool
 mvhd_is_conectix_str(const void* buffer)
 {
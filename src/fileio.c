@@ -0,0 +1,735 @@
+/*
+ * MiniVHD	Minimalist VHD implementation in C.
+ *
+ *		This file is part of the MiniVHD Project.
+ *
+ *		Storage backend handling, and the default (file) backend.
+ *
+ * Version:	@(#)fileio.c	1.0.0	2026/10/16
+ *
+ * Authors:	Sherman Perry, <shermperry@gmail.com>
+ *		Fred N. van Kempen, <waltje@varcem.com>
+ *
+ *		Copyright 2019-2021 Sherman Perry.
+ *		Copyright 2021 Fred N. van Kempen.
+ *
+ *		MIT License
+ *
+ *		Permission is hereby granted, free of  charge, to any person
+ *		obtaining a copy of this software  and associated documenta-
+ *		tion files (the "Software"), to deal in the Software without
+ *		restriction, including without limitation the rights to use,
+ *		copy, modify, merge, publish, distribute, sublicense, and/or
+ *		sell copies of  the Software, and  to permit persons to whom
+ *		the Software is furnished to do so, subject to the following
+ *		conditions:
+ *
+ *		The above  copyright notice and this permission notice shall
+ *		be included in  all copies or  substantial  portions of  the
+ *		Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING  BUT NOT LIMITED TO THE  WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN  NO EVENT  SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER  IN AN ACTION OF  CONTRACT, TORT OR  OTHERWISE, ARISING
+ * FROM, OUT OF  O R IN  CONNECTION WITH THE  SOFTWARE OR  THE USE  OR  OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _FILE_OFFSET_BITS
+# define _FILE_OFFSET_BITS 64
+#endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE	/* for fallocate() */
+#endif
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+# include <windows.h>
+# include <io.h>
+#else
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <sys/uio.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+#define BUILDING_LIBRARY
+#include "minivhd.h"
+#include "internal.h"
+
+
+/* State of an image file opened by the default backend. */
+typedef struct FileCtx {
+    FILE*	f;		/* owns the OS handle, but is not used for I/O */
+    intptr_t	handle;		/* file descriptor, or a HANDLE on Windows */
+    intptr_t	map_handle;	/* file mapping object on Windows */
+} FileCtx;
+
+
+/*
+ * The stdio stream is only used to open the file (so that unicode paths
+ * keep working on Windows) and to own the underlying descriptor. All actual
+ * I/O goes straight to the descriptor at an explicit offset, so there is no
+ * shared file position, and no double buffering through stdio.
+ */
+static void *
+file_open(void* user, const char* path, const char* mode, int* err)
+{
+    FileCtx* fc;
+
+    (void)user;
+
+    fc = calloc(1, sizeof *fc);
+    if (fc == NULL) {
+        *err = MVHD_ERR_MEM;
+        return NULL;
+    }
+
+    fc->f = mvhd_fopen(path, mode, err);
+    if (fc->f == NULL) {
+        free(fc);
+        return NULL;
+    }
+
+#ifdef _WIN32
+    fc->handle = (intptr_t)_get_osfhandle(_fileno(fc->f));
+#else
+    fc->handle = (intptr_t)fileno(fc->f);
+#endif
+
+    return fc;
+}
+
+
+static void
+file_close(void* ctx)
+{
+    FileCtx* fc = (FileCtx*)ctx;
+
+    fclose(fc->f);
+    free(fc);
+}
+
+
+/**
+ * \brief Perform a single positional read or write on the OS file handle
+ * 
+ * \param [in] fc The file to access
+ * \param [in] buffer The buffer to read into, or write from
+ * \param [in] size The number of bytes to transfer
+ * \param [in] offset The absolute file offset to transfer at
+ * \param [in] write true to write, false to read
+ * 
+ * \return The number of bytes transferred, 0 at end of file, or -1 on error
+ */
+static int64_t
+xfer_once(FileCtx* fc, void* buffer, size_t size, uint64_t offset, bool write)
+{
+#ifdef _WIN32
+    OVERLAPPED ov;
+    DWORD done = 0;
+    DWORD len = (size > 0x40000000) ? 0x40000000 : (DWORD)size;
+    BOOL ok;
+
+    memset(&ov, 0, sizeof ov);
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    if (write) {
+        ok = WriteFile((HANDLE)fc->handle, buffer, len, &done, &ov);
+    } else {
+        ok = ReadFile((HANDLE)fc->handle, buffer, len, &done, &ov);
+    }
+    if (!ok) {
+        if (!write && GetLastError() == ERROR_HANDLE_EOF) {
+            return 0;
+        }
+        mvhd_errno = EIO;
+        return -1;
+    }
+
+    return (int64_t)done;
+#else
+    ssize_t done;
+
+    do {
+        if (write) {
+            done = pwrite((int)fc->handle, buffer, size, (off_t)offset);
+        } else {
+            done = pread((int)fc->handle, buffer, size, (off_t)offset);
+        }
+    } while (done < 0 && errno == EINTR);
+
+    if (done < 0) {
+        mvhd_errno = errno;
+    }
+
+    return (int64_t)done;
+#endif
+}
+
+
+static int
+file_read_at(void* ctx, void* buffer, size_t size, uint64_t offset)
+{
+    uint8_t* buff = (uint8_t*)buffer;
+    int64_t done;
+
+    while (size > 0) {
+        done = xfer_once((FileCtx*)ctx, buff, size, offset, false);
+        if (done <= 0) {
+            /* Reading past the end of file gives us zeroes, like a sparse file would */
+            memset(buff, 0, size);
+            return -1;
+        }
+        buff += done;
+        size -= (size_t)done;
+        offset += done;
+    }
+
+    return 0;
+}
+
+
+static int
+file_write_at(void* ctx, const void* buffer, size_t size, uint64_t offset)
+{
+    uint8_t* buff = (uint8_t*)buffer;
+    int64_t done;
+
+    while (size > 0) {
+        done = xfer_once((FileCtx*)ctx, buff, size, offset, true);
+        if (done <= 0) {
+            return -1;
+        }
+        buff += done;
+        size -= (size_t)done;
+        offset += done;
+    }
+
+    return 0;
+}
+
+
+#ifndef _WIN32
+/* Most buffers handed to a single preadv() or pwritev() call */
+# define FILE_IOV_MAX	64
+
+
+/**
+ * \brief Do a vectored read or write on the default backend
+ * 
+ * Partial transfers are picked up where they stopped. A read that runs 
+ * into the end of file zeroes whatever is left.
+ * 
+ * \return 0 if all bytes were transferred, -1 otherwise
+ */
+static int
+xferv(FileCtx* fc, const MVHDIOVec* iov, int iovcnt, uint64_t offset, bool write)
+{
+    struct iovec vec[FILE_IOV_MAX];
+    size_t skip = 0;	/* bytes of iov[0] already done */
+    ssize_t done;
+    int i, n;
+
+    while (iovcnt > 0) {
+        for (n = 0; n < iovcnt && n < FILE_IOV_MAX; n++) {
+            vec[n].iov_base = (uint8_t*)iov[n].base + ((n == 0) ? skip : 0);
+            vec[n].iov_len = iov[n].len - ((n == 0) ? skip : 0);
+        }
+
+        do {
+            if (write) {
+                done = pwritev((int)fc->handle, vec, n, (off_t)offset);
+            } else {
+                done = preadv((int)fc->handle, vec, n, (off_t)offset);
+            }
+        } while (done < 0 && errno == EINTR);
+
+        if (done <= 0) {
+            if (done < 0) {
+                mvhd_errno = errno;
+            }
+            if (!write) {
+                for (i = 0; i < n; i++) {
+                    memset(vec[i].iov_base, 0, vec[i].iov_len);
+                }
+                for (; i < iovcnt; i++) {
+                    memset(iov[i].base, 0, iov[i].len);
+                }
+            }
+            return -1;
+        }
+
+        /* Skip over everything that was transferred */
+        offset += (uint64_t)done;
+        for (i = 0; i < n && (size_t)done >= vec[i].iov_len; i++) {
+            done -= (ssize_t)vec[i].iov_len;
+        }
+        skip = (i < n) ? (size_t)done + ((i == 0) ? skip : 0) : 0;
+        iov += i;
+        iovcnt -= i;
+    }
+
+    return 0;
+}
+#endif
+
+
+static int
+file_readv_at(void* ctx, const MVHDIOVec* iov, int iovcnt, uint64_t offset)
+{
+#ifdef _WIN32
+    int i, ret = 0;
+
+    /* There is no positional scatter/gather call for regular handles */
+    for (i = 0; i < iovcnt; i++) {
+        if (file_read_at(ctx, iov[i].base, iov[i].len, offset) != 0) {
+            ret = -1;
+        }
+        offset += iov[i].len;
+    }
+
+    return ret;
+#else
+    return xferv((FileCtx*)ctx, iov, iovcnt, offset, false);
+#endif
+}
+
+
+static int
+file_writev_at(void* ctx, const MVHDIOVec* iov, int iovcnt, uint64_t offset)
+{
+#ifdef _WIN32
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (file_write_at(ctx, iov[i].base, iov[i].len, offset) != 0) {
+            return -1;
+        }
+        offset += iov[i].len;
+    }
+
+    return 0;
+#else
+    return xferv((FileCtx*)ctx, iov, iovcnt, offset, true);
+#endif
+}
+
+
+static int64_t
+file_size(void* ctx)
+{
+    FileCtx* fc = (FileCtx*)ctx;
+#ifdef _WIN32
+    LARGE_INTEGER size;
+
+    if (!GetFileSizeEx((HANDLE)fc->handle, &size)) {
+        return -1;
+    }
+
+    return (int64_t)size.QuadPart;
+#else
+    struct stat st;
+
+    if (fstat((int)fc->handle, &st) != 0) {
+        mvhd_errno = errno;
+        return -1;
+    }
+
+    return (int64_t)st.st_size;
+#endif
+}
+
+
+static int
+file_truncate(void* ctx, uint64_t size)
+{
+    FileCtx* fc = (FileCtx*)ctx;
+#ifdef _WIN32
+    return _chsize_s(_fileno(fc->f), (__int64)size);
+#else
+    if (ftruncate((int)fc->handle, (off_t)size) != 0) {
+        mvhd_errno = errno;
+        return -1;
+    }
+
+    return 0;
+#endif
+}
+
+
+static int
+file_flush(void* ctx)
+{
+    FileCtx* fc = (FileCtx*)ctx;
+#ifdef _WIN32
+    if (!FlushFileBuffers((HANDLE)fc->handle)) {
+        mvhd_errno = EIO;
+        return -1;
+    }
+#else
+    if (fsync((int)fc->handle) != 0) {
+        mvhd_errno = errno;
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+
+static void
+file_hint(void* ctx, uint64_t offset, uint64_t size, int hint)
+{
+#if defined(POSIX_FADV_NORMAL) && !defined(_WIN32)
+    FileCtx* fc = (FileCtx*)ctx;
+    int advice;
+
+    switch (hint) {
+	case MVHD_HINT_SEQUENTIAL:
+		advice = POSIX_FADV_SEQUENTIAL;
+		break;
+
+	case MVHD_HINT_RANDOM:
+		advice = POSIX_FADV_RANDOM;
+		break;
+
+	case MVHD_HINT_WILLNEED:
+		advice = POSIX_FADV_WILLNEED;
+		break;
+
+	case MVHD_HINT_DONTNEED:
+		advice = POSIX_FADV_DONTNEED;
+		break;
+
+	default:
+		advice = POSIX_FADV_NORMAL;
+		break;
+    }
+
+    posix_fadvise((int)fc->handle, (off_t)offset, (off_t)size, advice);
+#else
+    /* Windows only takes access hints when opening a file */
+    (void)ctx;
+    (void)offset;
+    (void)size;
+    (void)hint;
+#endif
+}
+
+
+static int
+file_zero_at(void* ctx, uint64_t offset, uint64_t size)
+{
+#if defined(__linux__) && defined(FALLOC_FL_ZERO_RANGE)
+    FileCtx* fc = (FileCtx*)ctx;
+
+    /* Not every file system can zero a range, but most can punch a hole */
+    if (fallocate((int)fc->handle, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)size) == 0 ||
+        fallocate((int)fc->handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)size) == 0) {
+        return 0;
+    }
+    mvhd_errno = errno;
+#else
+    (void)ctx;
+    (void)offset;
+    (void)size;
+#endif
+
+    return -1;
+}
+
+
+static const MVHDIOOps file_ops = {
+    file_open,
+    file_close,
+    file_read_at,
+    file_write_at,
+    file_size,
+    file_truncate,
+    file_flush,
+    file_hint,
+    file_readv_at,
+    file_writev_at,
+    file_zero_at
+};
+
+
+MVHDAPI const MVHDIOOps *
+mvhd_default_io_ops(void)
+{
+    return &file_ops;
+}
+
+
+int
+mvhd_file_open(MVHDFile* file, const MVHDIOOps* ops, void* user, const char* path, const char* mode, int* err)
+{
+    memset(file, 0, sizeof *file);
+    file->ops = (ops != NULL) ? ops : &file_ops;
+    file->user = user;
+
+    file->ctx = file->ops->open(user, path, mode, err);
+    if (file->ctx == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void
+mvhd_file_close(MVHDFile* file)
+{
+#ifdef USE_URING
+    if (file->ring != NULL) {
+        mvhd_ring_destroy(file->ring);
+        file->ring = NULL;
+    }
+#endif
+    mvhd_file_unmap(file);
+
+    if (file->ctx != NULL) {
+        file->ops->close(file->ctx);
+        file->ctx = NULL;
+    }
+}
+
+
+int
+mvhd_read_at(MVHDFile* file, void* buffer, size_t size, uint64_t offset)
+{
+    return file->ops->read_at(file->ctx, buffer, size, offset);
+}
+
+
+int
+mvhd_write_at(MVHDFile* file, const void* buffer, size_t size, uint64_t offset)
+{
+    return file->ops->write_at(file->ctx, buffer, size, offset);
+}
+
+
+int
+mvhd_file_readv(MVHDFile* file, const MVHDIOVec* iov, int iovcnt, uint64_t offset)
+{
+    int i, ret = 0;
+
+    if (file->ops->readv_at != NULL) {
+        return file->ops->readv_at(file->ctx, iov, iovcnt, offset);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if (file->ops->read_at(file->ctx, iov[i].base, iov[i].len, offset) != 0) {
+            ret = -1;
+        }
+        offset += iov[i].len;
+    }
+
+    return ret;
+}
+
+
+int
+mvhd_file_writev(MVHDFile* file, const MVHDIOVec* iov, int iovcnt, uint64_t offset)
+{
+    int i;
+
+    if (file->ops->writev_at != NULL) {
+        return file->ops->writev_at(file->ctx, iov, iovcnt, offset);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if (file->ops->write_at(file->ctx, iov[i].base, iov[i].len, offset) != 0) {
+            return -1;
+        }
+        offset += iov[i].len;
+    }
+
+    return 0;
+}
+
+
+int64_t
+mvhd_file_size(MVHDFile* file)
+{
+    return file->ops->size(file->ctx);
+}
+
+
+int
+mvhd_file_truncate(MVHDFile* file, uint64_t size)
+{
+    if (file->ops->truncate == NULL) {
+        return -1;
+    }
+
+    return file->ops->truncate(file->ctx, size);
+}
+
+
+int
+mvhd_file_flush(MVHDFile* file)
+{
+    if (file->map != NULL) {
+#ifdef _WIN32
+        if (!FlushViewOfFile(file->map, 0)) {
+            mvhd_errno = EIO;
+            return -1;
+        }
+#else
+        if (msync(file->map, (size_t)file->map_size, MS_SYNC) != 0) {
+            mvhd_errno = errno;
+            return -1;
+        }
+#endif
+    }
+
+    if (file->ops->flush == NULL) {
+        return 0;
+    }
+
+    return file->ops->flush(file->ctx);
+}
+
+
+int
+mvhd_file_queue(MVHDFile* file, void* buffer, size_t size, uint64_t offset, bool write)
+{
+#ifdef USE_URING
+    if (file->ring != NULL) {
+        return mvhd_ring_queue(file->ring, buffer, size, offset, write);
+    }
+#endif
+
+    if (write) {
+        return mvhd_write_at(file, buffer, size, offset);
+    }
+
+    return mvhd_read_at(file, buffer, size, offset);
+}
+
+
+int
+mvhd_file_submit(MVHDFile* file)
+{
+#ifdef USE_URING
+    if (file->ring != NULL) {
+        return mvhd_ring_submit(file->ring);
+    }
+#else
+    (void)file;
+#endif
+
+    return 0;
+}
+
+
+int
+mvhd_file_enable_ring(MVHDFile* file)
+{
+#ifdef USE_URING
+    if (file->ops != &file_ops) {
+        return -1;
+    }
+
+    if (file->ring == NULL) {
+        file->ring = mvhd_ring_create((int)((FileCtx*)file->ctx)->handle, MVHD_RING_DEPTH);
+    }
+
+    return (file->ring != NULL) ? 0 : -1;
+#else
+    (void)file;
+
+    return -1;
+#endif
+}
+
+
+void
+mvhd_file_zero(MVHDFile* file, uint64_t offset, int sector_count)
+{
+    if (file->ops->zero_at != NULL && file->ops->zero_at(file->ctx, offset, (uint64_t)sector_count * MVHD_SECTOR_SIZE) == 0) {
+        return;
+    }
+
+    mvhd_write_empty_sectors(file, offset, sector_count);
+}
+
+
+void
+mvhd_file_hint(MVHDFile* file, uint64_t offset, uint64_t size, int hint)
+{
+    if (file->ops->hint != NULL) {
+        file->ops->hint(file->ctx, offset, size, hint);
+    }
+}
+
+
+int
+mvhd_file_map(MVHDFile* file, uint64_t size, bool writable)
+{
+    FileCtx* fc = (FileCtx*)file->ctx;
+
+    /* We need an OS handle to map, so only our own backend can do this */
+    if (file->ops != &file_ops || size == 0 || size > (uint64_t)SIZE_MAX) {
+        return -1;
+    }
+
+#ifdef _WIN32
+    HANDLE mapping;
+    void* view;
+
+    mapping = CreateFileMapping((HANDLE)fc->handle, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+                                (DWORD)(size >> 32), (DWORD)size, NULL);
+    if (mapping == NULL) {
+        return -1;
+    }
+    view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)size);
+    if (view == NULL) {
+        CloseHandle(mapping);
+        return -1;
+    }
+    file->map = (uint8_t*)view;
+    fc->map_handle = (intptr_t)mapping;
+#else
+    void* view;
+
+    view = mmap(NULL, (size_t)size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                MAP_SHARED, (int)fc->handle, 0);
+    if (view == MAP_FAILED) {
+        return -1;
+    }
+    file->map = (uint8_t*)view;
+#endif
+    file->map_size = size;
+
+    return 0;
+}
+
+
+void
+mvhd_file_unmap(MVHDFile* file)
+{
+    if (file->map == NULL) {
+        return;
+    }
+
+#ifdef _WIN32
+    FileCtx* fc = (FileCtx*)file->ctx;
+
+    UnmapViewOfFile(file->map);
+    CloseHandle((HANDLE)fc->map_handle);
+    fc->map_handle = 0;
+#else
+    munmap(file->map, (size_t)file->map_size);
+#endif
+    file->map = NULL;
+    file->map_size = 0;
+}
@@ -60,13 +60,75 @@
 
 #define MVHD_START_TS		946684800
 
+/* Number of block sector bitmaps cached per image, unless changed */
+#define MVHD_BITMAP_CACHE_DEFAULT 16
+
+/*
+ * Sector bitmaps are MSB first. The following bit array macros adapted from:
+ *
+ * http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html
+*/
+#define VHD_SETBIT(A,k)     ( A[(k>>3)] |= (0x80 >> (k&7)) )
+#define VHD_CLEARBIT(A,k)   ( A[(k>>3)] &= ~(0x80 >> (k&7)) )
+#define VHD_TESTBIT(A,k)    ( A[(k>>3)] & (0x80 >> (k&7)) )
+
+
+typedef struct MVHDBitmapEntry {
+    uint8_t*	bitmap;
+    int		block;
+    bool	busy;		/* being written back or loaded, without the cache mutex */
+    int		next_block;	/* while busy, the block being loaded */
+    bool	dirty;
+    int		dirty_first;	/* first and last modified bitmap sector */
+    int		dirty_last;
+    uint32_t	last_used;
+} MVHDBitmapEntry;
 
 typedef struct MVHDSectorBitmap {
-    uint8_t*	curr_bitmap;
+    MVHDBitmapEntry* entries;
+    uint8_t*	data;
+    int		num_entries;
     int		sector_count;
-    int		curr_block;
+    int		mru;
+    uint32_t	tick;
+    uint64_t	hits;
+    uint64_t	misses;
 } MVHDSectorBitmap;
 
+/* Number of requests an io_uring submission queue holds */
+#define MVHD_RING_DEPTH 64
+
+typedef struct MVHDRing MVHDRing;
+
+typedef struct MVHDFile {
+    const MVHDIOOps* ops;	/* storage backend of the file */
+    void*	user;		/* backend user data, for opening related files */
+    void*	ctx;		/* backend context of the open file */
+    uint8_t*	map;		/* memory mapping of the file, or NULL */
+    uint64_t	map_size;
+    MVHDRing*	ring;		/* io_uring for batched requests, or NULL */
+} MVHDFile;
+
+/* How a block of a differencing chain is resolved by the owner map */
+typedef enum MVHDOwnerKind {
+    MVHD_OWNER_ZERO = 0,	/**< No image in the chain holds data for the block */
+    MVHD_OWNER_FULL,		/**< All sectors are stored contiguously in one image */
+    MVHD_OWNER_SPARSE,		/**< One image holds some sectors, the rest are zero */
+    MVHD_OWNER_MIXED		/**< Partially written, the sector bitmaps must be used */
+} MVHDOwnerKind;
+
+typedef struct MVHDBlockOwner {
+    uint32_t	data_sect;	/* sector offset of the block data, for MVHD_OWNER_FULL */
+    uint8_t	layer;		/* index into the layers array, 0 being the child */
+    uint8_t	kind;
+} MVHDBlockOwner;
+
+typedef struct MVHDOwnerMap {
+    MVHDBlockOwner* blocks;
+    struct MVHDMeta** layers;
+    int		num_layers;
+} MVHDOwnerMap;
+
 typedef struct MVHDFooter {
     uint8_t	cookie[8];
     uint32_t	features;
@@ -112,18 +174,64 @@ typedef struct MVHDSparseHeader {
     uint8_t reserved_2[256];
 } MVHDSparseHeader;
 
+/* A range of sectors in an image file */
+typedef struct MVHDExtent {
+    uint32_t	sect;
+    uint32_t	count;
+} MVHDExtent;
+
+/* Portable threading primitives, from thread.c */
+typedef struct MVHDMutex MVHDMutex;
+typedef struct MVHDCond MVHDCond;
+typedef volatile long MVHDOnce;
+
+/* Number of block lock shards in thread-safe mode */
+#define MVHD_LOCK_SHARDS 16
+
+/*
+ * Locks of an image opened in thread-safe mode.
+ *
+ * A write holds the shards of all the blocks it touches. Reads take no locks
+ * of their own: BAT entries are published atomically once a new block is set
+ * up, and sector bitmap bits are only set after the data they cover has been
+ * written. The sector bitmap cache (and the block owner map, which is updated
+ * along with it) and the file end are global to the image, so they have a
+ * mutex of their own. Those are only held for short moments; a sector bitmap
+ * cache miss does its file I/O without holding the cache mutex.
+ */
+typedef struct MVHDLocks {
+    MVHDMutex*	shard[MVHD_LOCK_SHARDS];	/* block n is covered by shard n % MVHD_LOCK_SHARDS */
+    MVHDMutex*	cache;		/* sector bitmap cache and owner map */
+    MVHDCond*	cache_idle;	/* signalled when a cache entry is no longer busy */
+    MVHDMutex*	end;		/* footer and file size, see create_block() */
+} MVHDLocks;
+
 struct MVHDMeta {
-    FILE*	f;
+    MVHDFile	f;
     bool	readonly;
     char	filename[MVHD_MAX_PATH_BYTES];
     struct MVHDMeta* parent;
     MVHDFooter	footer;
+    int64_t	footer_pos;	/* file offset of the footer at the end of the file */
     MVHDSparseHeader sparse;
     uint32_t*	block_offset;
+    uint8_t*	bat_dirty;	/* one flag per BAT sector, in write-back mode */
+    bool	write_back;
     int		sect_per_block;
     MVHDSectorBitmap bitmap;
+    MVHDOwnerMap* owner_map;
+    struct MVHDAsync* async;	/* asynchronous I/O state, created on first use */
+    MVHDLocks*	locks;		/* only in thread-safe mode */
+    struct MVHDMeta* origin;	/* for a duplicate, the handle whose BAT and buffers it shares */
+    struct {
+        MVHDExtent*	ext;		/* unused parts of the file, see space.c */
+        int		num;
+        int		size;
+    }	free_space;
     int (*read_sectors)(struct MVHDMeta*, uint32_t, int, void*);
     int (*write_sectors)(struct MVHDMeta*, uint32_t, int, void*);
+    int (*readv_sectors)(struct MVHDMeta*, uint32_t, int, const MVHDIOVec*, int);
+    int (*writev_sectors)(struct MVHDMeta*, uint32_t, int, const MVHDIOVec*, int);
     struct {
         uint8_t*	zero_data;
         int		sector_count;
@@ -228,6 +336,165 @@ uint32_t mvhd_crc32_for_byte(uint32_t r);
  */
 int64_t mvhd_ftello64(FILE* stream);
 
+/**
+ * \brief Open an image file through a storage backend
+ * 
+ * \param [out] file The file structure to initialize
+ * \param [in] ops The storage backend to use, or NULL for the default one
+ * \param [in] user The user data to pass to the backend
+ * \param [in] path The filepath to open as a UTF-8 string
+ * \param [in] mode The mode string to use (eg: "rb+"")
+ * \param [out] err The error value, if an error occurrs
+ * 
+ * \return 0 if successful, -1 otherwise. If -1, check the value of err
+ */
+int mvhd_file_open(MVHDFile* file, const MVHDIOOps* ops, void* user, const char* path, const char* mode, int* err);
+
+/**
+ * \brief Close an image file opened with mvhd_file_open()
+ */
+void mvhd_file_close(MVHDFile* file);
+
+/**
+ * \brief Read from a file at the given offset
+ * 
+ * There is no file position, so with the default backend this is safe to 
+ * call from several threads at once. Any part of the buffer that could not 
+ * be read (such as past the end of file) is zeroed.
+ * 
+ * \param [in] file The file to read from
+ * \param [out] buffer The buffer to read into
+ * \param [in] size The number of bytes to read
+ * \param [in] offset The absolute file offset to read from
+ * 
+ * \return 0 if all bytes were read, -1 otherwise
+ */
+int mvhd_read_at(MVHDFile* file, void* buffer, size_t size, uint64_t offset);
+
+/**
+ * \brief Write to a file at the given offset
+ * 
+ * \param [in] file The file to write to
+ * \param [in] buffer The buffer to write from
+ * \param [in] size The number of bytes to write
+ * \param [in] offset The absolute file offset to write to
+ * 
+ * \return 0 if all bytes were written, -1 otherwise, with mvhd_errno set
+ */
+int mvhd_write_at(MVHDFile* file, const void* buffer, size_t size, uint64_t offset);
+
+/**
+ * \brief Read from a file at the given offset into a scatter/gather list
+ * 
+ * Backends without readv_at get one read_at per buffer.
+ * 
+ * \return 0 if all bytes were read, -1 otherwise
+ */
+int mvhd_file_readv(MVHDFile* file, const MVHDIOVec* iov, int iovcnt, uint64_t offset);
+
+/**
+ * \brief Write a scatter/gather list to a file at the given offset
+ * 
+ * Backends without writev_at get one write_at per buffer.
+ * 
+ * \return 0 if all bytes were written, -1 otherwise
+ */
+int mvhd_file_writev(MVHDFile* file, const MVHDIOVec* iov, int iovcnt, uint64_t offset);
+
+/**
+ * \brief Get the size of a file in bytes
+ * 
+ * \return The file size, or -1 on error
+ */
+int64_t mvhd_file_size(MVHDFile* file);
+
+/**
+ * \brief Truncate or extend a file to the given size
+ * 
+ * When extending, the new area reads as zeroes.
+ * 
+ * \return 0 if successful, non-zero otherwise
+ */
+int mvhd_file_truncate(MVHDFile* file, uint64_t size);
+
+/**
+ * \brief Make a range of sectors of a file read as zeroes
+ * 
+ * The backend is asked to zero the range in place, such as by punching a 
+ * hole. If it can't, zero filled sectors are written instead.
+ * 
+ * \param [in] file File to zero the sectors of
+ * \param [in] offset The absolute file offset to start zeroing at
+ * \param [in] sector_count The number of sectors to zero
+ */
+void mvhd_file_zero(MVHDFile* file, uint64_t offset, int sector_count);
+
+/**
+ * \brief Flush all written data of a file to stable storage
+ * 
+ * If the file is memory mapped, the mapping is synced first.
+ * 
+ * \return 0 if successful, -1 otherwise, with mvhd_errno set
+ */
+int mvhd_file_flush(MVHDFile* file);
+
+/**
+ * \brief Queue a read or write of a file
+ * 
+ * If the file has an io_uring, the request is only queued, and the buffer 
+ * must stay untouched until mvhd_file_submit() is called. Otherwise, the 
+ * request is performed right away.
+ * 
+ * \return 0 if successful (so far), -1 otherwise
+ */
+int mvhd_file_queue(MVHDFile* file, void* buffer, size_t size, uint64_t offset, bool write);
+
+/**
+ * \brief Perform all queued requests of a file, and wait for them to complete
+ * 
+ * \return 0 if all requests were successful, -1 otherwise
+ */
+int mvhd_file_submit(MVHDFile* file);
+
+/**
+ * \brief Set up an io_uring to perform the queued requests of a file
+ * 
+ * \return 0 if successful, -1 if io_uring is not available (also for other 
+ * than the default backend), in which case requests are not queued
+ */
+int mvhd_file_enable_ring(MVHDFile* file);
+
+/* The io_uring interface itself, from uring.c */
+MVHDRing* mvhd_ring_create(int fd, unsigned depth);
+void mvhd_ring_destroy(MVHDRing* ring);
+int mvhd_ring_queue(MVHDRing* ring, void* buffer, size_t size, uint64_t offset, bool write);
+int mvhd_ring_submit(MVHDRing* ring);
+
+/**
+ * \brief Pass an access pattern hint for a range of a file to its backend
+ */
+void mvhd_file_hint(MVHDFile* file, uint64_t offset, uint64_t size, int hint);
+
+/**
+ * \brief Map the start of a file into memory
+ * 
+ * The mapping is shared, so stores to it end up in the file, and positional
+ * I/O on the same file stays coherent with it.
+ * 
+ * \param [in] file The file to map
+ * \param [in] size The number of bytes to map, from the start of the file
+ * \param [in] writable true to map read/write, false for read only
+ * 
+ * \return 0 if successful, -1 otherwise (also for other than the default 
+ * backend), and the file is left unmapped
+ */
+int mvhd_file_map(MVHDFile* file, uint64_t size, bool writable);
+
+/**
+ * \brief Remove the memory mapping of a file, if any
+ */
+void mvhd_file_unmap(MVHDFile* file);
+
 /**
  * \brief Reposition the file stream's position
  * 
@@ -247,6 +514,33 @@ int mvhd_fseeko64(FILE* stream, int64_t offset, int origin);
  */
 uint32_t mvhd_crc32(const void* data, size_t n_bytes);
 
+/**
+ * \brief Check if a data buffer holds nothing but zeroes
+ * 
+ * On x86, this uses SSE2 or AVX2, depending on what the CPU supports.
+ * 
+ * \param [in] data The data buffer
+ * \param [in] n_bytes The size of the data buffer in bytes
+ * 
+ * \return true if all bytes are zero
+ */
+bool mvhd_is_zero(const void* data, size_t n_bytes);
+
+/**
+ * \brief Find the length of a run of equal bits in a sector bitmap
+ * 
+ * Whole bytes are skipped at a time where possible, so scanning a fully 
+ * allocated (or fully empty) block costs one comparison per eight sectors.
+ * 
+ * \param [in] bitmap The sector bitmap to scan
+ * \param [in] start The first bit of the run
+ * \param [in] end One past the last bit that may be part of the run
+ * \param [out] set Whether the bits in the run are set or clear
+ * 
+ * \return The number of consecutive bits, starting from start, that match
+ */
+int mvhd_bitmap_run_len(const uint8_t* bitmap, int start, int end, bool* set);
+
 /**
  * \brief Calculate the file modification timestamp.
  * 
@@ -260,18 +554,147 @@ uint32_t mvhd_crc32(const void* data, size_t n_bytes);
  */
 uint32_t mvhd_file_mod_timestamp(const char* path, int *err);
 
-struct MVHDMeta* mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, MVHDGeom* geom, int* err, mvhd_progress_callback progress_callback);
+struct MVHDMeta* mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, MVHDGeom* geom, int* err, mvhd_progress_callback progress_callback, const MVHDIOOps* io_ops, void* io_user);
 
 /**
  * \brief Write zero filled sectors to file.
  * 
- * Note, the caller should set the file position before calling this 
- * function for correct operation.
- * 
  * \param [in] f File to write sectors to
+ * \param [in] offset The absolute file offset to start writing at
  * \param [in] sector_count The number of sectors to write
  */
-void mvhd_write_empty_sectors(FILE* f, int sector_count);
+void mvhd_write_empty_sectors(MVHDFile* f, uint64_t offset, int sector_count);
+
+/**
+ * \brief Check if any image in a chain holds data for a range of sectors
+ * 
+ * The images of a chain may use different block sizes, so the BAT of each one
+ * is checked for all the blocks covering the range.
+ * 
+ * \param [in] vhdm The image at the top of the chain
+ * \param [in] offset The first sector of the range
+ * \param [in] num_sectors The number of sectors in the range
+ */
+bool mvhd_chain_has_data(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Allocate the sector bitmap cache of a sparse or differencing image
+ * 
+ * Any previously allocated cache is written back and released first, which 
+ * allows this function to also be used to resize the cache.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] num_entries The number of block bitmaps to keep in memory
+ * 
+ * \retval 0 if the cache was allocated
+ * \retval -1 if memory could not be allocated
+ */
+int mvhd_bitmap_cache_init(struct MVHDMeta* vhdm, int num_entries);
+
+/**
+ * \brief Write any modified sector bitmaps in the cache back to file
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_bitmap_cache_flush(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Write any modified BAT sectors back to file
+ * 
+ * Only used in write-back mode, where BAT updates are deferred.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_bat_flush(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Write back and release the sector bitmap cache
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_bitmap_cache_free(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Build the block owner map of a differencing image
+ * 
+ * For every block of the virtual disk, find the image in the chain that owns 
+ * it, so that reads of blocks which are not partially written in more than 
+ * one image can bypass the sector bitmaps. The map is only built if all sparse 
+ * images in the chain share the same block size.
+ * 
+ * \param [in] vhdm MiniVHD data structure of the child image
+ * 
+ * \retval 0 if the map was built, or the chain does not support one
+ * \retval -1 if memory could not be allocated
+ */
+int mvhd_owner_map_init(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Give a duplicate handle an owner map of its own, sharing the block entries
+ * 
+ * The layers of the map must be the duplicate's own parents, as reads go through
+ * their files and sector bitmap caches.
+ * 
+ * \param [in] dup MiniVHD data structure of the duplicate, with its parents set up
+ * \param [in] src The owner map of the original handle
+ * 
+ * \return 0 if successful, -1 if memory could not be allocated
+ */
+int mvhd_owner_map_share(struct MVHDMeta* dup, const MVHDOwnerMap* src);
+
+/**
+ * \brief Release the block owner map of a differencing image
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_owner_map_free(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Wait for all asynchronous requests on an image, and release its async state
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_async_free(struct MVHDMeta* vhdm);
+
+MVHDMutex* mvhd_mutex_create(void);
+void mvhd_mutex_destroy(MVHDMutex* m);
+void mvhd_mutex_lock(MVHDMutex* m);
+void mvhd_mutex_unlock(MVHDMutex* m);
+MVHDCond* mvhd_cond_create(void);
+void mvhd_cond_destroy(MVHDCond* c);
+void mvhd_cond_wait(MVHDCond* c, MVHDMutex* m);
+void mvhd_cond_signal(MVHDCond* c);
+void mvhd_cond_broadcast(MVHDCond* c);
+
+/*
+ * Atomic accesses, for fields that are read without locks in thread-safe
+ * mode. Loads have acquire and stores have release semantics.
+ */
+uint32_t mvhd_atomic_load32(const volatile uint32_t* p);
+void mvhd_atomic_store32(volatile uint32_t* p, uint32_t val);
+int64_t mvhd_atomic_load64(const volatile int64_t* p);
+
+/**
+ * \brief Atomically replace *p with desired, if it still holds *expected
+ * 
+ * \return true if replaced, false otherwise, with the current value in *expected
+ */
+bool mvhd_atomic_cas64(volatile int64_t* p, int64_t* expected, int64_t desired);
+
+/**
+ * \brief Start a detached thread
+ * 
+ * \return 0 if successful, -1 otherwise
+ */
+int mvhd_thread_start(void (*func)(void* arg), void* arg);
+
+/**
+ * \brief Call func exactly once, even if several threads get here at the same time
+ * 
+ * \param [in] once Flag remembering the call. Must be statically initialized to 0
+ * \param [in] func The function to call
+ */
+void mvhd_once(MVHDOnce* once, void (*func)(void));
 
 /**
  * \brief Read a fixed VHD image
@@ -290,6 +713,13 @@ void mvhd_write_empty_sectors(FILE* f, int sector_count);
  */
 int mvhd_fixed_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff);
 
+/**
+ * \brief Read a fixed VHD image into a scatter/gather list
+ * 
+ * See mvhd_fixed_read() and mvhd_readv_sectors().
+ */
+int mvhd_fixed_readv(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt);
+
 /**
  * \brief Read a sparse VHD image
  * 
@@ -310,6 +740,13 @@ int mvhd_fixed_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, voi
  */
 int mvhd_sparse_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff);
 
+/**
+ * \brief Read a sparse VHD image into a scatter/gather list
+ * 
+ * See mvhd_sparse_read() and mvhd_readv_sectors().
+ */
+int mvhd_sparse_readv(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt);
+
 /**
  * \brief Read a differencing VHD image
  * 
@@ -333,6 +770,14 @@ int mvhd_sparse_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, vo
  */
 int mvhd_diff_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff);
 
+/**
+ * \brief Read a differencing VHD image into a scatter/gather list
+ * 
+ * The sectors may come from any image in the chain, so they are read with 
+ * mvhd_diff_read() into a temporary buffer first.
+ */
+int mvhd_diff_readv(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt);
+
 /**
  * \brief Write to a fixed VHD image
  * 
@@ -350,6 +795,13 @@ int mvhd_diff_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void
  */
 int mvhd_fixed_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
 
+/**
+ * \brief Write to a fixed VHD image from a scatter/gather list
+ * 
+ * See mvhd_fixed_write() and mvhd_writev_sectors().
+ */
+int mvhd_fixed_writev(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt);
+
 /**
  * \brief Write to a sparse or differencing VHD image
  * 
@@ -375,6 +827,83 @@ int mvhd_fixed_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, vo
  */
 int mvhd_sparse_diff_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
 
+/**
+ * \brief Write to a sparse or differencing VHD image from a scatter/gather list
+ * 
+ * See mvhd_sparse_diff_write() and mvhd_writev_sectors().
+ */
+int mvhd_sparse_diff_writev(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt);
+
+/**
+ * \brief Build the list of unused space in a dynamic or differencing image
+ * 
+ * Any gap between the metadata and blocks in the file that can hold a block
+ * is recorded, so that create_block() can fill it. A gap may hold anything 
+ * another tool left behind, so it is zeroed when taken. This is not fatal if 
+ * it fails; new blocks then go at the end of the file.
+ * 
+ * \param [in] vhdm MiniVHD data structure, with the BAT read
+ */
+void mvhd_free_space_init(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Record a range of sectors as unused
+ * 
+ * In thread-safe mode, the caller must hold the locks->end mutex for this and 
+ * for mvhd_free_space_take().
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] sect The first sector of the range
+ * \param [in] count The number of sectors in the range
+ */
+void mvhd_free_space_add(struct MVHDMeta* vhdm, uint32_t sect, uint32_t count);
+
+/**
+ * \brief Take a range of unused sectors
+ * 
+ * The range is not cleared, so the caller must zero what it doesn't write.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] count The number of sectors wanted
+ * \param [out] sect The first sector of the range taken
+ * 
+ * \return true if a large enough range was found, false otherwise
+ */
+bool mvhd_free_space_take(struct MVHDMeta* vhdm, uint32_t count, uint32_t* sect);
+
+/**
+ * \brief Release the list of unused space
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_free_space_free(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Get the number of bytes set aside for a parent locator
+ * 
+ * The VHD spec says plat_data_space is in sectors, but Hyper-V and VPC 
+ * store bytes (see create.c). If it can't be bytes, it's sectors.
+ * 
+ * \param [in] sparse The sparse header holding the locator
+ * \param [in] i The index of the locator entry
+ */
+uint64_t mvhd_par_loc_bytes(const MVHDSparseHeader* sparse, int i);
+
+/**
+ * \brief Discard sectors of a dynamic or differencing image
+ * 
+ * The sectors are marked as unused in the sector bitmaps. Blocks that end up 
+ * with no used sectors at all are made sparse again, and their space in the 
+ * file is reused for the next block that is created.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to discard from
+ * \param [in] num_sectors The desired number of sectors to discard
+ * 
+ * \return the number of sectors that were not discarded, or zero
+ */
+int mvhd_sparse_diff_discard(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
 /**
  * \brief A no-op function to "write" to read-only VHD images
  * 
@@ -389,6 +918,28 @@ int mvhd_sparse_diff_write(struct MVHDMeta* vhdm, uint32_t offset, int num_secto
  */
 int mvhd_noop_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
 
+/**
+ * \brief A no-op function to "write" a scatter/gather list to read-only VHD images
+ */
+int mvhd_noop_writev(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt);
+
+/**
+ * \brief Do a batch of sector reads and writes in file order
+ * 
+ * Runs of requests that do not depend on each other are translated through 
+ * the BAT, sorted by file offset, merged where adjacent, and then issued. A 
+ * request that overlaps an earlier write (or a write that overlaps an earlier
+ * request) starts a new run, so the outcome is the same as doing the requests
+ * one by one, in array order.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] reqs The requests. Their result fields are set
+ * \param [in] count The number of requests
+ * 
+ * \return The number of requests that were not done in full
+ */
+int mvhd_batch_xfer(struct MVHDMeta* vhdm, MVHDBatchReq* reqs, int count);
+
 /**
  * \brief Save the contents of a VHD footer from a buffer to a struct
  * 
@@ -47,14 +47,190 @@
 #include "internal.h"
 
 
-/*
- * The following bit array macros adapted from:
- *
- * http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html
-*/
-#define VHD_SETBIT(A,k)     ( A[(k>>3)] |= (0x80 >> (k&7)) )
-#define VHD_CLEARBIT(A,k)   ( A[(k>>3)] &= ~(0x80 >> (k&7)) )
-#define VHD_TESTBIT(A,k)    ( A[(k>>3)] & (0x80 >> (k&7)) )
+/* Most scatter/gather entries handed to a single read or write call */
+#define IOV_SLICE_MAX	32
+
+
+/* Position in a scatter/gather list */
+typedef struct IOVCursor {
+    const MVHDIOVec* iov;
+    int		cnt;
+    int		idx;
+    size_t	off;		/* offset into iov[idx] */
+} IOVCursor;
+
+
+static void
+iov_cursor(IOVCursor* cur, const MVHDIOVec* iov, int cnt)
+{
+    cur->iov = iov;
+    cur->cnt = cnt;
+    cur->idx = 0;
+    cur->off = 0;
+}
+
+
+/**
+ * \brief Set up a cursor for a single contiguous buffer of sectors
+ */
+static void
+iov_single(MVHDIOVec* iov, IOVCursor* cur, void* buff, int num_sectors)
+{
+    iov->base = buff;
+    iov->len = (num_sectors > 0) ? (size_t)num_sectors * MVHD_SECTOR_SIZE : 0;
+    iov_cursor(cur, iov, 1);
+}
+
+
+/**
+ * \brief Take the next bytes from a scatter/gather list
+ * 
+ * \param [in] cur The cursor to take from, which is advanced
+ * \param [in] bytes The number of bytes wanted
+ * \param [out] slice The buffers covering the bytes taken, at most IOV_SLICE_MAX
+ * \param [out] n The number of entries stored in slice
+ * 
+ * \return The number of bytes taken. Less than wanted if slice is full, or the list ends
+ */
+static size_t
+iov_take(IOVCursor* cur, size_t bytes, MVHDIOVec* slice, int* n)
+{
+    size_t taken = 0, len;
+
+    *n = 0;
+    while (taken < bytes && cur->idx < cur->cnt && *n < IOV_SLICE_MAX) {
+        len = cur->iov[cur->idx].len - cur->off;
+        if (len > bytes - taken) {
+            len = bytes - taken;
+        }
+        if (len > 0) {
+            slice[*n].base = (uint8_t*)cur->iov[cur->idx].base + cur->off;
+            slice[*n].len = len;
+            (*n)++;
+            taken += len;
+            cur->off += len;
+        }
+        if (cur->off == cur->iov[cur->idx].len) {
+            cur->idx++;
+            cur->off = 0;
+        }
+    }
+
+    return taken;
+}
+
+
+/**
+ * \brief Fill the next bytes of a scatter/gather list with zeroes
+ */
+static void
+iov_zero(IOVCursor* cur, size_t bytes)
+{
+    MVHDIOVec slice[IOV_SLICE_MAX];
+    size_t done;
+    int i, n;
+
+    for (; bytes > 0; bytes -= done) {
+        done = iov_take(cur, bytes, slice, &n);
+        if (done == 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            memset(slice[i].base, 0, slice[i].len);
+        }
+    }
+}
+
+
+/**
+ * \brief Skip over the next bytes of a scatter/gather list
+ */
+static void
+iov_skip(IOVCursor* cur, size_t bytes)
+{
+    MVHDIOVec slice[IOV_SLICE_MAX];
+    size_t done;
+    int n;
+
+    for (; bytes > 0; bytes -= done) {
+        done = iov_take(cur, bytes, slice, &n);
+        if (done == 0) {
+            break;
+        }
+    }
+}
+
+
+/**
+ * \brief Check if the next bytes of a scatter/gather list are all zeroes
+ * 
+ * The cursor is left where it is.
+ */
+static bool
+iov_is_zero(const IOVCursor* cur, size_t bytes)
+{
+    MVHDIOVec slice[IOV_SLICE_MAX];
+    IOVCursor peek = *cur;
+    size_t done;
+    int i, n;
+
+    for (; bytes > 0; bytes -= done) {
+        done = iov_take(&peek, bytes, slice, &n);
+        if (done == 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (!mvhd_is_zero(slice[i].base, slice[i].len)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * \brief Transfer the next bytes of a scatter/gather list to or from a file
+ * 
+ * A part that is contiguous in memory is a plain read or write, which is queued
+ * if requested. Otherwise, a vectored read or write is done right away.
+ * 
+ * \param [in] f The file to transfer to or from
+ * \param [in] cur The buffers to transfer, which is advanced
+ * \param [in] bytes The number of bytes to transfer
+ * \param [in] addr The file offset to transfer at
+ * \param [in] write true to write, false to read
+ * \param [in] queue true to queue plain transfers, see mvhd_file_queue()
+ */
+static void
+xfer_iov(MVHDFile* f, IOVCursor* cur, size_t bytes, uint64_t addr, bool write, bool queue)
+{
+    MVHDIOVec slice[IOV_SLICE_MAX];
+    size_t done;
+    int n;
+
+    for (; bytes > 0; bytes -= done) {
+        done = iov_take(cur, bytes, slice, &n);
+        if (done == 0) {
+            break;
+        }
+        if (n > 1) {
+            if (write) {
+                mvhd_file_writev(f, slice, n, addr);
+            } else {
+                mvhd_file_readv(f, slice, n, addr);
+            }
+        } else if (queue) {
+            mvhd_file_queue(f, slice[0].base, slice[0].len, addr, write);
+        } else if (write) {
+            mvhd_write_at(f, slice[0].base, slice[0].len, addr);
+        } else {
+            mvhd_read_at(f, slice[0].base, slice[0].len, addr);
+        }
+        addr += done;
+    }
+}
 
 
 /**
@@ -81,302 +257,1475 @@ check_sectors(uint32_t offset, int num_sectors, uint32_t total_sectors, int* tra
 
 
 void
-mvhd_write_empty_sectors(FILE* f, int sector_count)
+mvhd_write_empty_sectors(MVHDFile* f, uint64_t offset, int sector_count)
 {
-    uint8_t zero_bytes[MVHD_SECTOR_SIZE] = {0};
-    int i;
+    uint8_t zero_bytes[MVHD_SECTOR_SIZE * 8] = {0};
+    int n;
+
+    for (; sector_count > 0; sector_count -= n) {
+        n = (sector_count < 8) ? sector_count : 8;
+        mvhd_write_at(f, zero_bytes, (size_t)n * MVHD_SECTOR_SIZE, offset);
+        offset += (uint64_t)n * MVHD_SECTOR_SIZE;
+    }
+}
+
+
+int
+mvhd_bitmap_run_len(const uint8_t* bitmap, int start, int end, bool* set)
+{
+    int k = start;
+    uint8_t fill;
 
-    for (i = 0; i < sector_count; i++) {
-        fwrite(zero_bytes, sizeof zero_bytes, 1, f);
+    *set = VHD_TESTBIT(bitmap, k) != 0;
+    fill = *set ? 0xff : 0x00;
+
+    /* Finish off the partial byte we started in */
+    while (k < end && (k & 7) != 0) {
+        if ((VHD_TESTBIT(bitmap, k) != 0) != *set)
+            return k - start;
+        k++;
+    }
+
+    /* Then compare whole bytes */
+    while ((k + 8) <= end && bitmap[k >> 3] == fill) {
+        k += 8;
+    }
+
+    /* And whatever remains */
+    while (k < end && (VHD_TESTBIT(bitmap, k) != 0) == *set) {
+        k++;
     }
+
+    return k - start;
 }
 
 
 /**
- * \brief Read the sector bitmap for a block.
- * 
- * If the block is sparse, the sector bitmap in memory will be 
- * zeroed. Otherwise, the sector bitmap is read from the VHD file.
+ * \brief Set a range of bits in a sector bitmap
  * 
- * \param [in] vhdm MiniVHD data structure
- * \param [in] blk The block for which to read the sector bitmap from
+ * \param [in] bitmap The sector bitmap to update
+ * \param [in] start The first bit to set
+ * \param [in] end One past the last bit to set
  */
 static void
-read_sect_bitmap(MVHDMeta* vhdm, int blk)
+bitmap_set_range(uint8_t* bitmap, int start, int end)
 {
-    if (vhdm->block_offset[blk] != MVHD_SPARSE_BLK) {
-        mvhd_fseeko64(vhdm->f, (uint64_t)vhdm->block_offset[blk] * MVHD_SECTOR_SIZE, SEEK_SET);
-        fread(vhdm->bitmap.curr_bitmap, vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE, 1, vhdm->f);
-    } else {
-        memset(vhdm->bitmap.curr_bitmap, 0, vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+    int k = start;
+
+    while (k < end && (k & 7) != 0) {
+        VHD_SETBIT(bitmap, k);
+        k++;
+    }
+
+    if ((end - k) >= 8) {
+        memset(&bitmap[k >> 3], 0xff, (end - k) >> 3);
+        k += (end - k) & ~7;
     }
 
-    vhdm->bitmap.curr_block = blk;
+    while (k < end) {
+        VHD_SETBIT(bitmap, k);
+        k++;
+    }
 }
 
 
 /**
- * \brief Write the current sector bitmap in memory to file
+ * \brief Clear a range of bits in a sector bitmap
  * 
- * \param [in] vhdm MiniVHD data structure
+ * \param [in] bitmap The sector bitmap to update
+ * \param [in] start The first bit to clear
+ * \param [in] end One past the last bit to clear
  */
 static void
-write_curr_sect_bitmap(MVHDMeta* vhdm)
+bitmap_clear_range(uint8_t* bitmap, int start, int end)
 {
-    if (vhdm->bitmap.curr_block >= 0) {
-        int64_t abs_offset = (int64_t)vhdm->block_offset[vhdm->bitmap.curr_block] * MVHD_SECTOR_SIZE;
-        mvhd_fseeko64(vhdm->f, abs_offset, SEEK_SET);
-        fwrite(vhdm->bitmap.curr_bitmap, MVHD_SECTOR_SIZE, vhdm->bitmap.sector_count, vhdm->f);
+    int k = start;
+
+    while (k < end && (k & 7) != 0) {
+        VHD_CLEARBIT(bitmap, k);
+        k++;
+    }
+
+    if ((end - k) >= 8) {
+        memset(&bitmap[k >> 3], 0x00, (end - k) >> 3);
+        k += (end - k) & ~7;
+    }
+
+    while (k < end) {
+        VHD_CLEARBIT(bitmap, k);
+        k++;
     }
 }
 
 
 /**
- * \brief Write block offset from memory into file
+ * \brief Look up the BAT entry of a block
+ * 
+ * In thread-safe mode, readers look the BAT up without locks while writers
+ * may be allocating blocks, so entries are loaded atomically.
  * 
  * \param [in] vhdm MiniVHD data structure
- * \param [in] blk The block for which to write the offset for
+ * \param [in] blk The block to look up
+ * 
+ * \return the sector offset of the block, or MVHD_SPARSE_BLK
  */
-static void
-write_bat_entry(MVHDMeta* vhdm, int blk)
+static inline uint32_t
+bat_entry(MVHDMeta* vhdm, int blk)
 {
-    uint64_t table_offset = vhdm->sparse.bat_offset + ((uint64_t)blk * sizeof *vhdm->block_offset);
-    uint32_t offset = mvhd_to_be32(vhdm->block_offset[blk]);
+    if (vhdm->locks == NULL) {
+        return vhdm->block_offset[blk];
+    }
 
-    mvhd_fseeko64(vhdm->f, table_offset, SEEK_SET);
-    fwrite(&offset, sizeof offset, 1, vhdm->f);
+    return mvhd_atomic_load32(&vhdm->block_offset[blk]);
 }
 
 
 /**
- * \brief Create an empty block in a sparse or differencing VHD image
+ * \brief Read the sector bitmap for a block.
  * 
- * VHD images store data in blocks, which are typically 4096 sectors in size 
- * (~2MB). These blocks may be stored on disk in any order. Blocks are created 
- * on demand when required.
+ * If the block is sparse, the sector bitmap in memory will be 
+ * zeroed. Otherwise, the sector bitmap is read from the VHD file.
  * 
- * This function creates new, empty blocks, by replacing the footer at the end of the file 
- * and then re-inserting the footer at the new file end. The BAT table entry for the
- * new block is updated with the new offset.
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk_offset The BAT entry of the block to read the sector bitmap of
+ * \param [out] bitmap Buffer to store the bitmap in
+ */
+static void
+read_sect_bitmap(MVHDMeta* vhdm, uint32_t blk_offset, uint8_t* bitmap)
+{
+    if (blk_offset != MVHD_SPARSE_BLK) {
+        mvhd_read_at(&vhdm->f, bitmap, (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE, (uint64_t)blk_offset * MVHD_SECTOR_SIZE);
+    } else {
+        memset(bitmap, 0, vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+    }
+}
+
+
+/**
+ * \brief Write a cached sector bitmap to file
  * 
  * \param [in] vhdm MiniVHD data structure
- * \param [in] blk The block number to create
+ * \param [in] ent The cache entry holding the bitmap to write
  */
 static void
-create_block(MVHDMeta* vhdm, int blk)
+write_sect_bitmap(MVHDMeta* vhdm, MVHDBitmapEntry* ent)
 {
-    uint8_t footer[MVHD_FOOTER_SIZE];
+    /* Only the bitmap sectors that were modified need to be written */
+    int64_t abs_offset = ((int64_t)bat_entry(vhdm, ent->block) + ent->dirty_first) * MVHD_SECTOR_SIZE;
+
+    mvhd_file_queue(&vhdm->f, ent->bitmap + (ent->dirty_first * MVHD_SECTOR_SIZE), (size_t)(ent->dirty_last - ent->dirty_first + 1) * MVHD_SECTOR_SIZE, abs_offset, true);
+    ent->dirty = false;
+}
+
 
-    /* Seek to where the footer SHOULD be */
-    mvhd_fseeko64(vhdm->f, -MVHD_FOOTER_SIZE, SEEK_END);
-    fread(footer, sizeof footer, 1, vhdm->f);
-    mvhd_fseeko64(vhdm->f, -MVHD_FOOTER_SIZE, SEEK_END);
+/**
+ * \brief Mark a range of bits in a cached sector bitmap as modified
+ * 
+ * \param [in] ent The cache entry holding the modified bitmap
+ * \param [in] start The first modified bit
+ * \param [in] end One past the last modified bit
+ */
+static void
+mark_sect_bitmap_dirty(MVHDBitmapEntry* ent, int start, int end)
+{
+    int first = start / (MVHD_SECTOR_SIZE * 8);
+    int last = (end - 1) / (MVHD_SECTOR_SIZE * 8);
 
-    if (!mvhd_is_conectix_str(footer)) {
-        /* Oh dear. We use the header instead, since something has gone wrong at the footer */
-        mvhd_fseeko64(vhdm->f, 0, SEEK_SET);
-        fread(footer, sizeof footer, 1, vhdm->f);
-        mvhd_fseeko64(vhdm->f, 0, SEEK_END);
+    if (!ent->dirty) {
+        ent->dirty = true;
+        ent->dirty_first = first;
+        ent->dirty_last = last;
+        return;
     }
 
-    int64_t abs_offset = mvhd_ftello64(vhdm->f);
-    if (abs_offset % MVHD_SECTOR_SIZE != 0) {
-        /* Yikes! We're supposed to be on a sector boundary. Add some padding */
-        int64_t padding_amount = (int64_t)MVHD_SECTOR_SIZE - (abs_offset % MVHD_SECTOR_SIZE);
-        uint8_t zero_byte = 0;
-        int i;
-        for (i = 0; i < padding_amount; i++) {
-            fwrite(&zero_byte, sizeof zero_byte, 1, vhdm->f);
-        }
-        abs_offset += padding_amount;
+    if (first < ent->dirty_first) {
+        ent->dirty_first = first;
     }
+    if (last > ent->dirty_last) {
+        ent->dirty_last = last;
+    }
+}
 
-    uint32_t sect_offset = (uint32_t)(abs_offset / MVHD_SECTOR_SIZE);
-    int blk_size_sectors = vhdm->sparse.block_sz / MVHD_SECTOR_SIZE;
-    mvhd_write_empty_sectors(vhdm->f, vhdm->bitmap.sector_count + blk_size_sectors);
 
-    /* Add a bit of padding. That's what Windows appears to do, although it's not strictly necessary... */
-    mvhd_write_empty_sectors(vhdm->f, 5);
+/* The sector bitmap cache is shared by all threads in thread-safe mode. */
+static inline void
+cache_lock(MVHDMeta* vhdm)
+{
+    if (vhdm->locks != NULL) {
+        mvhd_mutex_lock(vhdm->locks->cache);
+    }
+}
 
-    /* And we finish with the footer */
-    fwrite(footer, sizeof footer, 1, vhdm->f);
 
-    /* We no longer have a sparse block. Update that BAT! */
-    vhdm->block_offset[blk] = sect_offset;
-    write_bat_entry(vhdm, blk);
+static inline void
+cache_unlock(MVHDMeta* vhdm)
+{
+    if (vhdm->locks != NULL) {
+        mvhd_mutex_unlock(vhdm->locks->cache);
+    }
 }
 
 
-int
-mvhd_fixed_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff) {
-    int64_t addr;
-    int transfer_sectors, truncated_sectors;
-    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
-
-    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+/* Wait for another thread to finish with a busy cache entry, see lookup_sect_bitmap(). */
+static inline void
+cache_wait(MVHDMeta* vhdm)
+{
+    if (vhdm->locks != NULL) {
+        mvhd_cond_wait(vhdm->locks->cache_idle, vhdm->locks->cache);
+    }
+}
 
-    addr = (int64_t)offset * MVHD_SECTOR_SIZE;
-    mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
-    fread(out_buff, transfer_sectors*MVHD_SECTOR_SIZE, 1, vhdm->f);
 
-    return truncated_sectors;
+static inline void
+cache_wake(MVHDMeta* vhdm)
+{
+    if (vhdm->locks != NULL) {
+        mvhd_cond_broadcast(vhdm->locks->cache_idle);
+    }
 }
 
 
-int
-mvhd_sparse_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff)
+/**
+ * \brief Get the sector bitmap for a block.
+ * 
+ * The bitmap is looked up in the bitmap cache first. On a miss, the least 
+ * recently used entry is written back (if modified) and reused. If the block 
+ * is sparse, the sector bitmap in memory will be zeroed. Otherwise, the sector 
+ * bitmap is read from the VHD file.
+ * 
+ * In thread-safe mode, this is called with the cache mutex held, but the file
+ * I/O of a miss is done without it. The entry is marked busy meanwhile, so no
+ * other thread uses it, nor loads either block it is busy with.
+ * 
+ * Note that the returned entry is only valid until the next call to this 
+ * function for the same image, as it may be evicted to make room.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block for which to get the sector bitmap
+ * \param [in] blk_offset The BAT entry of blk, as loaded by the caller
+ * 
+ * \return The cache entry holding the sector bitmap of blk
+ */
+static MVHDBitmapEntry*
+lookup_sect_bitmap(MVHDMeta* vhdm, int blk, uint32_t blk_offset)
 {
-    int transfer_sectors, truncated_sectors;
-    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    MVHDSectorBitmap* bm = &vhdm->bitmap;
+    MVHDBitmapEntry* ent;
+    int i, victim;
 
-    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+again:
+    ent = &bm->entries[bm->mru];
+    if (ent->block == blk && !ent->busy) {
+        bm->hits++;
+        ent->last_used = ++bm->tick;
+        return ent;
+    }
 
-    uint8_t* buff = (uint8_t*)out_buff;
-    int64_t addr;
-    uint32_t s, ls;
-    int blk, prev_blk, sib;
-    ls = offset + transfer_sectors;
-    prev_blk = -1;
+    victim = -1;
+    for (i = 0; i < bm->num_entries; i++) {
+        ent = &bm->entries[i];
+        if (ent->block == blk || (ent->busy && ent->next_block == blk)) {
+            break;
+        }
+        if (!ent->busy && (victim < 0 || ent->last_used < bm->entries[victim].last_used)) {
+            victim = i;
+        }
+    }
 
-    for (s = offset; s < ls; s++) {
-        blk = s / vhdm->sect_per_block;
-        sib = s % vhdm->sect_per_block;
-        if (blk != prev_blk) {
-            prev_blk = blk;
-            if (vhdm->bitmap.curr_block != blk) {
-                read_sect_bitmap(vhdm, blk);
-                mvhd_fseeko64(vhdm->f, (uint64_t)sib * MVHD_SECTOR_SIZE, SEEK_CUR);
-            } else {
-                addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
-                mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
-            }
-        }        
+    if (i < bm->num_entries) {
+        if (ent->busy) {
+            cache_wait(vhdm);
+            goto again;
+        }
+        bm->hits++;
+    } else if (victim < 0) {
+        /* Every entry is being reused by another thread */
+        cache_wait(vhdm);
+        goto again;
+    } else {
+        bm->misses++;
+        i = victim;
+        ent = &bm->entries[i];
+        ent->busy = true;
+        ent->next_block = blk;
+        cache_unlock(vhdm);
 
-        if (VHD_TESTBIT(vhdm->bitmap.curr_bitmap, sib)) {
-            fread(buff, MVHD_SECTOR_SIZE, 1, vhdm->f);
-        } else {
-            memset(buff, 0, MVHD_SECTOR_SIZE);
-            mvhd_fseeko64(vhdm->f, MVHD_SECTOR_SIZE, SEEK_CUR);
+        if (ent->dirty) {
+            /**
+             * The buffer is reused right away, so this can't wait in the queue.
+             * Any data queued so far goes out on its own first, as the ring may
+             * complete the requests of one batch in any order.
+             */
+            mvhd_file_submit(&vhdm->f);
+            write_sect_bitmap(vhdm, ent);
+            mvhd_file_submit(&vhdm->f);
+        }
+        read_sect_bitmap(vhdm, blk_offset, ent->bitmap);
+
+        cache_lock(vhdm);
+        ent->busy = false;
+        ent->block = blk;
+        if (bat_entry(vhdm, blk) != blk_offset) {
+            /* A reader raced a discard of the block, so this copy is only good for that reader */
+            ent->block = -1;
         }
-        buff += MVHD_SECTOR_SIZE;
+        cache_wake(vhdm);
     }
 
-    return truncated_sectors;
+    bm->mru = i;
+    ent = &bm->entries[i];
+    ent->last_used = ++bm->tick;
+
+    return ent;
 }
 
 
-int
-mvhd_diff_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff)
+/* As lookup_sect_bitmap(), for callers that hold the block in place. */
+static MVHDBitmapEntry*
+get_sect_bitmap(MVHDMeta* vhdm, int blk)
 {
-    int transfer_sectors, truncated_sectors;
-    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    return lookup_sect_bitmap(vhdm, blk, bat_entry(vhdm, blk));
+}
 
-    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
 
-    uint8_t* buff = (uint8_t*)out_buff;
-    MVHDMeta* curr_vhdm = vhdm;
-    uint32_t s, ls;
-    int blk, sib;
-    ls = offset + transfer_sectors;
+/* Private copy of a sector bitmap, see peek_sect_bitmap(). */
+typedef struct BitmapSnap {
+    uint8_t*	bitmap;
+    uint8_t	local[MVHD_SECTOR_SIZE];
+} BitmapSnap;
 
-    for (s = offset; s < ls; s++) {
-        while (curr_vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
-            blk = s / curr_vhdm->sect_per_block;
-            sib = s % curr_vhdm->sect_per_block;
-            if (curr_vhdm->bitmap.curr_block != blk) {
-                read_sect_bitmap(curr_vhdm, blk);
-            }
-            if (!VHD_TESTBIT(curr_vhdm->bitmap.curr_bitmap, sib)) {
-                curr_vhdm = curr_vhdm->parent;
-            } else { break; }
-        }
 
-        /* We handle actual sector reading using the fixed or sparse functions,
-           as a differencing VHD is also a sparse VHD */
-        if (curr_vhdm->footer.disk_type == MVHD_TYPE_DIFF || curr_vhdm->footer.disk_type == MVHD_TYPE_DYNAMIC) {
-            mvhd_sparse_read(curr_vhdm, s, 1, buff);
-        } else {
-            mvhd_fixed_read(curr_vhdm, s, 1, buff);
+/**
+ * \brief Prepare room for a private copy of a sector bitmap
+ * 
+ * \return 0 if successful, -1 if out of memory
+ */
+static int
+snap_init(MVHDMeta* vhdm, BitmapSnap* snap)
+{
+    snap->bitmap = snap->local;
+    if (vhdm->locks != NULL && vhdm->bitmap.sector_count > 1) {
+        snap->bitmap = malloc((size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+        if (snap->bitmap == NULL) {
+            return -1;
         }
-
-        curr_vhdm = vhdm;
-        buff += MVHD_SECTOR_SIZE;
     }
 
-    return truncated_sectors;
+    return 0;
 }
 
 
-int
-mvhd_fixed_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
+static void
+snap_free(BitmapSnap* snap)
 {
-    int64_t addr;
-    int transfer_sectors, truncated_sectors;
-    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    if (snap->bitmap != snap->local) {
+        free(snap->bitmap);
+    }
+}
 
-    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
 
-    addr = (int64_t)offset * MVHD_SECTOR_SIZE;
-    mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
-    fwrite(in_buff, transfer_sectors*MVHD_SECTOR_SIZE, 1, vhdm->f);
+/**
+ * \brief Get the sector bitmap of a block, for reading only
+ * 
+ * In thread-safe mode, another thread may evict the cache entry as soon as
+ * we let go of the cache, so the bitmap is copied out while we hold it.
+ * Readers don't lock the block, so the BAT entry they checked is passed in
+ * rather than loaded again, as a concurrent discard may have cleared it.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block for which to get the sector bitmap
+ * \param [in] blk_offset The BAT entry of blk, as loaded by the caller
+ * \param [in] snap Room for the copy, set up by snap_init()
+ * 
+ * \return The sector bitmap of blk
+ */
+static const uint8_t *
+peek_sect_bitmap(MVHDMeta* vhdm, int blk, uint32_t blk_offset, BitmapSnap* snap)
+{
+    if (vhdm->locks == NULL) {
+        return lookup_sect_bitmap(vhdm, blk, blk_offset)->bitmap;
+    }
 
-    return truncated_sectors;
+    mvhd_mutex_lock(vhdm->locks->cache);
+    memcpy(snap->bitmap, lookup_sect_bitmap(vhdm, blk, blk_offset)->bitmap, (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+    mvhd_mutex_unlock(vhdm->locks->cache);
+
+    return snap->bitmap;
 }
 
 
 int
-mvhd_sparse_diff_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
+mvhd_bitmap_cache_init(MVHDMeta* vhdm, int num_entries)
 {
-    int transfer_sectors, truncated_sectors;
-    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    MVHDBitmapEntry* entries;
+    uint8_t* data;
+    size_t bm_size = (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE;
+    int i;
 
-    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    if (num_entries < 1) {
+        num_entries = 1;
+    }
 
-    uint8_t* buff = (uint8_t*)in_buff;
-    int64_t addr;
-    uint32_t s, ls;
-    int blk, prev_blk, sib;
+    entries = calloc(num_entries, sizeof *entries);
+    data = calloc(num_entries, bm_size);
+    if (entries == NULL || data == NULL) {
+        free(entries);
+        free(data);
+        return -1;
+    }
+
+    /* Out with the old.. */
+    mvhd_bitmap_cache_free(vhdm);
+
+    for (i = 0; i < num_entries; i++) {
+        entries[i].bitmap = data + (i * bm_size);
+        entries[i].block = -1;
+    }
+    vhdm->bitmap.entries = entries;
+    vhdm->bitmap.data = data;
+    vhdm->bitmap.num_entries = num_entries;
+    vhdm->bitmap.mru = 0;
+    vhdm->bitmap.tick = 0;
+    vhdm->bitmap.hits = 0;
+    vhdm->bitmap.misses = 0;
+
+    return 0;
+}
+
+
+void
+mvhd_bitmap_cache_flush(MVHDMeta* vhdm)
+{
+    int i;
+
+    /* An entry that is being reused may still have to be written back by its thread */
+    for (i = 0; i < vhdm->bitmap.num_entries; i++) {
+        if (vhdm->bitmap.entries[i].busy) {
+            cache_wait(vhdm);
+            i = -1;
+        }
+    }
+
+    /* The data the bitmaps cover must not share a batch with them */
+    mvhd_file_submit(&vhdm->f);
+    for (i = 0; i < vhdm->bitmap.num_entries; i++) {
+        if (vhdm->bitmap.entries[i].dirty) {
+            write_sect_bitmap(vhdm, &vhdm->bitmap.entries[i]);
+        }
+    }
+    mvhd_file_submit(&vhdm->f);
+}
+
+
+void
+mvhd_bitmap_cache_free(MVHDMeta* vhdm)
+{
+    if (vhdm->bitmap.entries == NULL) {
+        return;
+    }
+
+    mvhd_bitmap_cache_flush(vhdm);
+
+    free(vhdm->bitmap.entries);
+    vhdm->bitmap.entries = NULL;
+    free(vhdm->bitmap.data);
+    vhdm->bitmap.data = NULL;
+    vhdm->bitmap.num_entries = 0;
+}
+
+
+/**
+ * \brief Write block offset from memory into file
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block for which to write the offset for
+ */
+static void
+write_bat_entry(MVHDMeta* vhdm, int blk)
+{
+    uint64_t table_offset = vhdm->sparse.bat_offset + ((uint64_t)blk * sizeof *vhdm->block_offset);
+    uint32_t offset = mvhd_to_be32(bat_entry(vhdm, blk));
+
+    mvhd_write_at(&vhdm->f, &offset, sizeof offset, table_offset);
+}
+
+
+void
+mvhd_bat_flush(MVHDMeta* vhdm)
+{
+    uint32_t one_sect[MVHD_BAT_ENT_PER_SECT];
+    uint32_t* bat_sect;
+    uint32_t* bat_buff;
+    uint32_t i, j, first, n, dirty;
+
+    if (vhdm->bat_dirty == NULL) {
+        return;
+    }
+
+    n = (vhdm->sparse.max_bat_ent + MVHD_BAT_ENT_PER_SECT - 1) / MVHD_BAT_ENT_PER_SECT;
+    for (dirty = i = 0; i < n; i++) {
+        dirty += vhdm->bat_dirty[i];
+    }
+    if (dirty == 0) {
+        return;
+    }
+
+    /* Each queued sector needs its own buffer. Without one, write them one by one */
+    bat_buff = malloc((size_t)dirty * sizeof one_sect);
+
+    bat_sect = (bat_buff != NULL) ? bat_buff : one_sect;
+    for (i = 0; i < n; i++) {
+        if (!vhdm->bat_dirty[i]) {
+            continue;
+        }
+
+        /* The last BAT sector may only be partially used */
+        first = i * MVHD_BAT_ENT_PER_SECT;
+        for (j = 0; j < MVHD_BAT_ENT_PER_SECT && (first + j) < vhdm->sparse.max_bat_ent; j++) {
+            bat_sect[j] = mvhd_to_be32(vhdm->block_offset[first + j]);
+        }
+
+        if (bat_buff != NULL) {
+            mvhd_file_queue(&vhdm->f, bat_sect, j * sizeof *bat_sect, vhdm->sparse.bat_offset + ((uint64_t)first * sizeof *vhdm->block_offset), true);
+            bat_sect += MVHD_BAT_ENT_PER_SECT;
+        } else {
+            mvhd_write_at(&vhdm->f, bat_sect, j * sizeof *bat_sect, vhdm->sparse.bat_offset + ((uint64_t)first * sizeof *vhdm->block_offset));
+        }
+        vhdm->bat_dirty[i] = 0;
+    }
+
+    mvhd_file_submit(&vhdm->f);
+    free(bat_buff);
+}
+
+
+/**
+ * \brief Get the number of sectors of a block that lie within the virtual disk
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block number
+ */
+static int
+block_valid_sectors(MVHDMeta* vhdm, int blk)
+{
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    uint32_t start = (uint32_t)blk * vhdm->sect_per_block;
+
+    if ((total_sectors - start) < (uint32_t)vhdm->sect_per_block) {
+        return (int)(total_sectors - start);
+    }
+
+    return vhdm->sect_per_block;
+}
+
+
+int
+mvhd_owner_map_init(MVHDMeta* vhdm)
+{
+    MVHDOwnerMap* map;
+    MVHDBlockOwner* own;
+    MVHDMeta* curr_vhdm;
+    uint8_t* bitmap;
+    uint32_t blk;
+    int i, n, valid, run, layer;
+    bool set, found;
+
+    /* Every sparse image must split the disk the same way for this to work */
+    n = 0;
+    for (curr_vhdm = vhdm; curr_vhdm != NULL; curr_vhdm = curr_vhdm->parent) {
+        if (curr_vhdm->footer.disk_type != MVHD_TYPE_FIXED && curr_vhdm->sect_per_block != vhdm->sect_per_block) {
+            return 0;
+        }
+        n++;
+    }
+    if (n > 255) {
+        return 0;
+    }
+
+    map = calloc(1, sizeof *map);
+    if (map == NULL) {
+        return -1;
+    }
+    map->blocks = calloc(vhdm->sparse.max_bat_ent, sizeof *map->blocks);
+    map->layers = calloc(n, sizeof *map->layers);
+    bitmap = malloc((size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+    if (map->blocks == NULL || map->layers == NULL || bitmap == NULL) {
+        free(map->blocks);
+        free(map->layers);
+        free(map);
+        free(bitmap);
+        return -1;
+    }
+
+    map->num_layers = n;
+    i = 0;
+    for (curr_vhdm = vhdm; curr_vhdm != NULL; curr_vhdm = curr_vhdm->parent) {
+        map->layers[i++] = curr_vhdm;
+    }
+
+    for (blk = 0; blk < vhdm->sparse.max_bat_ent; blk++) {
+        own = &map->blocks[blk];
+        own->kind = MVHD_OWNER_ZERO;
+        found = false;
+
+        for (layer = 0; layer < n; layer++) {
+            curr_vhdm = map->layers[layer];
+
+            if (curr_vhdm->footer.disk_type == MVHD_TYPE_FIXED) {
+                /* A fixed image has data for everything not yet claimed */
+                if (!found) {
+                    own->kind = MVHD_OWNER_FULL;
+                    own->layer = (uint8_t)layer;
+                    own->data_sect = blk * vhdm->sect_per_block;
+                } else {
+                    own->kind = MVHD_OWNER_MIXED;
+                }
+                break;
+            }
+
+            if (curr_vhdm->block_offset[blk] == MVHD_SPARSE_BLK) {
+                continue;
+            }
+
+            read_sect_bitmap(curr_vhdm, bat_entry(curr_vhdm, blk), bitmap);
+            valid = block_valid_sectors(curr_vhdm, blk);
+            run = mvhd_bitmap_run_len(bitmap, 0, valid, &set);
+            if (run == valid && !set) {
+                /* Allocated, but never written to */
+                continue;
+            }
+
+            if (found) {
+                /* Two images each hold part of the block */
+                own->kind = MVHD_OWNER_MIXED;
+                break;
+            }
+
+            own->layer = (uint8_t)layer;
+            if (run == valid) {
+                own->kind = MVHD_OWNER_FULL;
+                own->data_sect = curr_vhdm->block_offset[blk] + curr_vhdm->bitmap.sector_count;
+                break;
+            }
+
+            /* Partially written. That's fine, as long as nothing below has data */
+            own->kind = MVHD_OWNER_SPARSE;
+            if (curr_vhdm->footer.disk_type == MVHD_TYPE_DYNAMIC) {
+                break;
+            }
+            found = true;
+        }
+    }
+
+    free(bitmap);
+    vhdm->owner_map = map;
+
+    return 0;
+}
+
+
+int
+mvhd_owner_map_share(MVHDMeta* dup, const MVHDOwnerMap* src)
+{
+    MVHDOwnerMap* map;
+    MVHDMeta* curr_vhdm;
+    int i;
+
+    map = calloc(1, sizeof *map);
+    if (map == NULL) {
+        return -1;
+    }
+    map->layers = calloc(src->num_layers, sizeof *map->layers);
+    if (map->layers == NULL) {
+        free(map);
+        return -1;
+    }
+
+    map->blocks = src->blocks;
+    map->num_layers = src->num_layers;
+    i = 0;
+    for (curr_vhdm = dup; curr_vhdm != NULL && i < map->num_layers; curr_vhdm = curr_vhdm->parent) {
+        map->layers[i++] = curr_vhdm;
+    }
+    dup->owner_map = map;
+
+    return 0;
+}
+
+
+void
+mvhd_owner_map_free(MVHDMeta* vhdm)
+{
+    if (vhdm->owner_map == NULL) {
+        return;
+    }
+
+    /* A duplicate borrows the block entries from the original */
+    if (vhdm->origin == NULL) {
+        free(vhdm->owner_map->blocks);
+    }
+    free(vhdm->owner_map->layers);
+    free(vhdm->owner_map);
+    vhdm->owner_map = NULL;
+}
+
+
+/**
+ * \brief Update the owner map after a block of the child image was written
+ * 
+ * \param [in] vhdm MiniVHD data structure of the child image
+ * \param [in] blk The block that was written to
+ * \param [in] bitmap The (updated) sector bitmap of blk
+ */
+static void
+update_block_owner(MVHDMeta* vhdm, int blk, uint8_t* bitmap)
+{
+    MVHDBlockOwner* own = &vhdm->owner_map->blocks[blk];
+    int n = block_valid_sectors(vhdm, blk);
+    bool set;
+
+    if (mvhd_bitmap_run_len(bitmap, 0, n, &set) == n && set) {
+        /* The child now holds the entire block */
+        own->kind = MVHD_OWNER_FULL;
+        own->layer = 0;
+        own->data_sect = bat_entry(vhdm, blk) + vhdm->bitmap.sector_count;
+    } else if (own->kind == MVHD_OWNER_ZERO || (own->kind == MVHD_OWNER_SPARSE && own->layer == 0)) {
+        own->kind = MVHD_OWNER_SPARSE;
+        own->layer = 0;
+    } else {
+        own->kind = MVHD_OWNER_MIXED;
+    }
+}
+
+
+/**
+ * \brief Add an empty block at the end of a sparse or differencing VHD image
+ * 
+ * This function creates new, empty blocks, by replacing the footer at the end of the file 
+ * and then re-inserting the footer at the new file end.
+ * 
+ * Only the sector bitmap (which overwrites the old footer) is actually written. The 
+ * rest of the block is created by extending the file, which the OS zero fills for 
+ * us. The footer is written from the copy we keep in memory.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \return The sector offset of the new block
+ */
+static uint32_t
+append_block(MVHDMeta* vhdm)
+{
+    uint8_t footer[MVHD_FOOTER_SIZE];
+    uint8_t* zero_data;
+    int64_t old_end, abs_offset, new_end;
+    int64_t blk_bytes;
+    bool grown;
+
+    int blk_size_sectors = vhdm->sparse.block_sz / MVHD_SECTOR_SIZE;
+    blk_bytes = (int64_t)(vhdm->bitmap.sector_count + blk_size_sectors) * MVHD_SECTOR_SIZE;
+
+    /*
+     * Reserve our part of the file by moving the end past it, so that writers
+     * to other blocks can carry on setting up theirs at the same time.
+     */
+    old_end = mvhd_atomic_load64(&vhdm->footer_pos);
+    do {
+        abs_offset = old_end;
+        if (abs_offset % MVHD_SECTOR_SIZE != 0) {
+            /* Yikes! We're supposed to be on a sector boundary. Add some padding */
+            abs_offset += (int64_t)MVHD_SECTOR_SIZE - (abs_offset % MVHD_SECTOR_SIZE);
+        }
+
+        /* Add a bit of padding. That's what Windows appears to do, although it's not strictly necessary... */
+        new_end = abs_offset + blk_bytes + (5 * MVHD_SECTOR_SIZE);
+    } while (!mvhd_atomic_cas64(&vhdm->footer_pos, &old_end, new_end));
+
+    uint32_t sect_offset = (uint32_t)(abs_offset / MVHD_SECTOR_SIZE);
+
+    /* Whoever last wrote the footer where our block now starts must be done with it */
+    if (vhdm->locks != NULL) {
+        mvhd_mutex_lock(vhdm->locks->end);
+        mvhd_mutex_unlock(vhdm->locks->end);
+    }
+
+    /* Overwrite the old footer (and any padding) with an empty sector bitmap */
+    if (abs_offset != old_end) {
+        memset(footer, 0, sizeof footer);
+        mvhd_write_at(&vhdm->f, footer, (size_t)(abs_offset - old_end), old_end);
+    }
+    mvhd_write_empty_sectors(&vhdm->f, abs_offset, vhdm->bitmap.sector_count);
+
+    /*
+     * The footer goes at the end of the file, which may have moved on since
+     * our reservation. Growing the file and writing it are done together, so
+     * the file never ends up shorter than the last footer position.
+     */
+    if (vhdm->locks != NULL) {
+        mvhd_mutex_lock(vhdm->locks->end);
+    }
+    new_end = mvhd_atomic_load64(&vhdm->footer_pos);
+    grown = (mvhd_file_truncate(&vhdm->f, new_end) == 0);
+
+    /* And we finish with the footer */
+    mvhd_footer_to_buffer(&vhdm->footer, footer);
+    mvhd_write_at(&vhdm->f, footer, sizeof footer, new_end);
+    if (vhdm->locks != NULL) {
+        mvhd_mutex_unlock(vhdm->locks->end);
+    }
+
+    if (!grown) {
+        /* Can't grow the file that way, so write the zeroes ourselves, in one go */
+        new_end = abs_offset + blk_bytes + (5 * MVHD_SECTOR_SIZE);
+        zero_data = calloc(1, (size_t)(new_end - abs_offset));
+        if (zero_data != NULL) {
+            mvhd_write_at(&vhdm->f, zero_data, (size_t)(new_end - abs_offset), abs_offset);
+            free(zero_data);
+        } else {
+            mvhd_write_empty_sectors(&vhdm->f, abs_offset + (vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE), blk_size_sectors + 5);
+        }
+    }
+
+    return sect_offset;
+}
+
+
+/**
+ * \brief Take unused space in the file for a block, to save growing the file
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [out] sect_offset The sector offset of the space
+ * 
+ * \return true if there was enough free space, false otherwise
+ */
+static bool
+take_free_block(MVHDMeta* vhdm, uint32_t* sect_offset)
+{
+    uint32_t slot = (uint32_t)(vhdm->bitmap.sector_count + vhdm->sect_per_block);
+    bool found;
+
+    if (vhdm->locks != NULL) {
+        mvhd_mutex_lock(vhdm->locks->end);
+    }
+    found = mvhd_free_space_take(vhdm, slot, sect_offset);
+    if (vhdm->locks != NULL) {
+        mvhd_mutex_unlock(vhdm->locks->end);
+    }
+
+    return found;
+}
+
+
+/**
+ * \brief Create an empty block in a sparse or differencing VHD image
+ * 
+ * VHD images store data in blocks, which are typically 4096 sectors in size 
+ * (~2MB). These blocks may be stored on disk in any order. Blocks are created 
+ * on demand when required.
+ * 
+ * Unused space in the file, such as that of a block that was discarded, is 
+ * used first. The whole block is zeroed there, as other readers of the image 
+ * may not go by the sector bitmap, and the old data must not show through. 
+ * Otherwise, the block is added at the end of the file. The BAT table entry 
+ * for the new block is updated with the new offset.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block number to create
+ */
+static void
+create_block(MVHDMeta* vhdm, int blk)
+{
+    uint32_t sect_offset;
+
+    if (take_free_block(vhdm, &sect_offset)) {
+        mvhd_file_zero(&vhdm->f, (uint64_t)sect_offset * MVHD_SECTOR_SIZE, vhdm->bitmap.sector_count + vhdm->sect_per_block);
+    } else {
+        sect_offset = append_block(vhdm);
+    }
+
+    /*
+     * We no longer have a sparse block. Update that BAT! Readers may look the
+     * entry up at any time, so it's only published once the block is set up.
+     */
+    mvhd_atomic_store32(&vhdm->block_offset[blk], sect_offset);
+    if (vhdm->write_back) {
+        /* The dirty flags are per BAT sector, which other blocks share */
+        if (vhdm->locks != NULL) {
+            mvhd_mutex_lock(vhdm->locks->end);
+        }
+        vhdm->bat_dirty[blk / MVHD_BAT_ENT_PER_SECT] = 1;
+        if (vhdm->locks != NULL) {
+            mvhd_mutex_unlock(vhdm->locks->end);
+        }
+    } else {
+        write_bat_entry(vhdm, blk);
+    }
+}
+
+
+/**
+ * \brief Turn an allocated block with nothing left in it back into a sparse one
+ * 
+ * The block's space is recorded as free, to be reused by create_block().
+ * The cleared BAT entry is written through even in write-back mode, as the
+ * space may be handed to another block whose data reaches the disk before
+ * the BAT is flushed.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block to free
+ */
+static void
+free_block(MVHDMeta* vhdm, int blk)
+{
+    uint32_t sect_offset = bat_entry(vhdm, blk);
+
+    /* The BAT must no longer point at the space before it can be reused */
+    mvhd_atomic_store32(&vhdm->block_offset[blk], MVHD_SPARSE_BLK);
+    write_bat_entry(vhdm, blk);
+
+    if (vhdm->locks != NULL) {
+        mvhd_mutex_lock(vhdm->locks->end);
+    }
+    mvhd_free_space_add(vhdm, sect_offset, (uint32_t)(vhdm->bitmap.sector_count + vhdm->sect_per_block));
+
+    if (vhdm->locks != NULL) {
+        mvhd_mutex_unlock(vhdm->locks->end);
+    }
+}
+
+
+/**
+ * \brief Read a run of sectors from an allocated block
+ * 
+ * The read is queued on the image file, so the caller must call mvhd_file_submit()
+ * before using the data.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk_offset The BAT entry of the block to read from. Must not be sparse
+ * \param [in] sib The sector in the block to start reading from
+ * \param [in] num_sectors The number of sectors to read, without crossing the block end
+ * \param [out] buff An output buffer to store read sectors
+ */
+static void
+read_block_data(MVHDMeta* vhdm, uint32_t blk_offset, int sib, int num_sectors, uint8_t* buff)
+{
+    int64_t addr = ((int64_t)blk_offset + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
+
+    mvhd_file_queue(&vhdm->f, buff, (size_t)num_sectors * MVHD_SECTOR_SIZE, addr, false);
+}
+
+
+/**
+ * \brief Transfer sectors of a fixed image, to or from a scatter/gather list
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to transfer at
+ * \param [in] num_sectors The desired number of sectors to transfer
+ * \param [in] cur The buffers to transfer to or from
+ * \param [in] write true to write, false to read
+ * 
+ * \return the number of sectors that were not transferred, or zero
+ */
+static int
+fixed_xfer(MVHDMeta* vhdm, uint32_t offset, int num_sectors, IOVCursor* cur, bool write)
+{
+    MVHDIOVec slice[IOV_SLICE_MAX];
+    int64_t addr;
+    size_t bytes, done;
+    int i, n;
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+
+    addr = (int64_t)offset * MVHD_SECTOR_SIZE;
+    bytes = (size_t)transfer_sectors * MVHD_SECTOR_SIZE;
+    if (vhdm->f.map == NULL) {
+        xfer_iov(&vhdm->f, cur, bytes, addr, write, false);
+        return truncated_sectors;
+    }
+
+    for (; bytes > 0; bytes -= done) {
+        done = iov_take(cur, bytes, slice, &n);
+        if (done == 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (write) {
+                memcpy(vhdm->f.map + addr, slice[i].base, slice[i].len);
+            } else {
+                memcpy(slice[i].base, vhdm->f.map + addr, slice[i].len);
+            }
+            addr += slice[i].len;
+        }
+    }
+
+    return truncated_sectors;
+}
+
+
+int
+mvhd_fixed_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff) {
+    MVHDIOVec iov;
+    IOVCursor cur;
+
+    iov_single(&iov, &cur, out_buff, num_sectors);
+
+    return fixed_xfer(vhdm, offset, num_sectors, &cur, false);
+}
+
+
+int
+mvhd_fixed_readv(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt)
+{
+    IOVCursor cur;
+
+    iov_cursor(&cur, iov, iovcnt);
+
+    return fixed_xfer(vhdm, offset, num_sectors, &cur, false);
+}
+
+
+/**
+ * \brief Read sectors from a dynamic image into a scatter/gather list
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to read from
+ * \param [in] num_sectors The desired number of sectors to read
+ * \param [in] cur The buffers to read into
+ * 
+ * \return the number of sectors that were not read, or zero
+ */
+static int
+sparse_read_iov(MVHDMeta* vhdm, uint32_t offset, int num_sectors, IOVCursor* cur)
+{
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+
+    BitmapSnap snap;
+    const uint8_t* bitmap;
+    int64_t addr;
+    uint32_t s, ls, blk_offset;
+    int blk, sib, lsib, i, run;
+    bool set;
+    ls = offset + transfer_sectors;
+
+    if (snap_init(vhdm, &snap) == -1) {
+        return num_sectors;
+    }
+
+    for (s = offset; s < ls; s += (lsib - sib)) {
+        blk = s / vhdm->sect_per_block;
+        sib = s % vhdm->sect_per_block;
+        lsib = vhdm->sect_per_block;
+        if ((ls - s) < (uint32_t)(lsib - sib)) {
+            lsib = sib + (int)(ls - s);
+        }
+
+        blk_offset = bat_entry(vhdm, blk);
+        if (blk_offset == MVHD_SPARSE_BLK) {
+            /* Nothing has ever been written to this block */
+            iov_zero(cur, (size_t)(lsib - sib) * MVHD_SECTOR_SIZE);
+            continue;
+        }
+
+        bitmap = peek_sect_bitmap(vhdm, blk, blk_offset, &snap);
+
+        /* Service each run of sectors with a single read or fill */
+        for (i = sib; i < lsib; i += run) {
+            run = mvhd_bitmap_run_len(bitmap, i, lsib, &set);
+            if (set) {
+                addr = ((int64_t)blk_offset + vhdm->bitmap.sector_count + i) * MVHD_SECTOR_SIZE;
+                xfer_iov(&vhdm->f, cur, (size_t)run * MVHD_SECTOR_SIZE, addr, false, true);
+            } else {
+                iov_zero(cur, (size_t)run * MVHD_SECTOR_SIZE);
+            }
+        }
+    }
+
+    /* Wait for the block data reads that were queued */
+    mvhd_file_submit(&vhdm->f);
+    snap_free(&snap);
+
+    return truncated_sectors;
+}
+
+
+int
+mvhd_sparse_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff)
+{
+    MVHDIOVec iov;
+    IOVCursor cur;
+
+    iov_single(&iov, &cur, out_buff, num_sectors);
+
+    return sparse_read_iov(vhdm, offset, num_sectors, &cur);
+}
+
+
+int
+mvhd_sparse_readv(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt)
+{
+    IOVCursor cur;
+
+    iov_cursor(&cur, iov, iovcnt);
+
+    return sparse_read_iov(vhdm, offset, num_sectors, &cur);
+}
+
+
+/**
+ * \brief Read a range of sectors from an image in a differencing chain
+ * 
+ * The range is resolved block by block. Within each block of a differencing 
+ * image, the sector bitmap is split into extents of set and clear bits. Set 
+ * extents are read from this image with a single read, while clear extents 
+ * are resolved (recursively) by the parent image, again as one range.
+ * 
+ * \param [in] vhdm MiniVHD data structure of the image to read from
+ * \param [in] offset Sector offset to read from
+ * \param [in] num_sectors The number of sectors to read. Must be within range
+ * \param [out] buff An output buffer to store read sectors
+ * 
+ * \return the number of sectors at the end of the range that were not read, or zero
+ */
+static int
+read_chain_range(MVHDMeta* vhdm, uint32_t offset, int num_sectors, uint8_t* buff)
+{
+    BitmapSnap snap;
+    const uint8_t* bitmap;
+    uint32_t s, ls, blk_offset;
+    int blk, sib, lsib, i, run;
+    int ret = 0;
+    bool set;
+
+    /* We handle actual sector reading using the fixed or sparse functions,
+       as a differencing VHD is also a sparse VHD */
+    if (vhdm->footer.disk_type == MVHD_TYPE_FIXED) {
+        return mvhd_fixed_read(vhdm, offset, num_sectors, buff);
+    }
+    if (vhdm->footer.disk_type == MVHD_TYPE_DYNAMIC) {
+        return mvhd_sparse_read(vhdm, offset, num_sectors, buff);
+    }
+
+    if (snap_init(vhdm, &snap) == -1) {
+        return num_sectors;
+    }
+
+    ls = offset + num_sectors;
+    for (s = offset; s < ls; s += (lsib - sib)) {
+        blk = s / vhdm->sect_per_block;
+        sib = s % vhdm->sect_per_block;
+        lsib = vhdm->sect_per_block;
+        if ((ls - s) < (uint32_t)(lsib - sib)) {
+            lsib = sib + (int)(ls - s);
+        }
+
+        blk_offset = bat_entry(vhdm, blk);
+        if (blk_offset == MVHD_SPARSE_BLK) {
+            /* The whole extent belongs to the parent */
+            ret = read_chain_range(vhdm->parent, s, lsib - sib, buff);
+            if (ret != 0) {
+                ret += (int)(ls - (s + (lsib - sib)));
+                goto end;
+            }
+            buff += (lsib - sib) * MVHD_SECTOR_SIZE;
+            continue;
+        }
+
+        /* Only the parent's cache is used while recursing, so this stays valid */
+        bitmap = peek_sect_bitmap(vhdm, blk, blk_offset, &snap);
+
+        for (i = sib; i < lsib; i += run) {
+            run = mvhd_bitmap_run_len(bitmap, i, lsib, &set);
+            if (set) {
+                read_block_data(vhdm, blk_offset, i, run, buff);
+            } else {
+                ret = read_chain_range(vhdm->parent, s + (i - sib), run, buff);
+                if (ret != 0) {
+                    ret += (int)(ls - (s + (i - sib) + run));
+                    goto end;
+                }
+            }
+            buff += run * MVHD_SECTOR_SIZE;
+        }
+    }
+
+end:
+    /* What was queued before a failure is still ours to wait for */
+    mvhd_file_submit(&vhdm->f);
+    snap_free(&snap);
+
+    return ret;
+}
+
+
+int
+mvhd_diff_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff)
+{
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+
+    if (vhdm->owner_map == NULL) {
+        return truncated_sectors + read_chain_range(vhdm, offset, transfer_sectors, (uint8_t*)out_buff);
+    }
+
+    uint8_t* buff = (uint8_t*)out_buff;
+    MVHDBlockOwner own;
+    MVHDMeta* layer;
+    int64_t addr;
+    uint32_t s, ls;
+    int blk, sib, n, left;
+    ls = offset + transfer_sectors;
+
+    for (s = offset; s < ls; s += n) {
+        blk = s / vhdm->sect_per_block;
+        sib = s % vhdm->sect_per_block;
+        n = vhdm->sect_per_block - sib;
+        if ((ls - s) < (uint32_t)n) {
+            n = (int)(ls - s);
+        }
+
+        /* Writers update the owner map along with the sector bitmap cache */
+        cache_lock(vhdm);
+        own = vhdm->owner_map->blocks[blk];
+        cache_unlock(vhdm);
+
+        layer = vhdm->owner_map->layers[own.layer];
+        left = 0;
+        switch (own.kind) {
+            case MVHD_OWNER_ZERO:
+                memset(buff, 0, (size_t)n * MVHD_SECTOR_SIZE);
+                break;
+
+            case MVHD_OWNER_FULL:
+                addr = ((int64_t)own.data_sect + sib) * MVHD_SECTOR_SIZE;
+                mvhd_read_at(&layer->f, buff, (size_t)n * MVHD_SECTOR_SIZE, addr);
+                break;
+
+            case MVHD_OWNER_SPARSE:
+                left = mvhd_sparse_read(layer, s, n, buff);
+                break;
+
+            default:
+                left = read_chain_range(vhdm, s, n, buff);
+                break;
+        }
+        if (left != 0) {
+            return truncated_sectors + left + (int)(ls - (s + n));
+        }
+        buff += n * MVHD_SECTOR_SIZE;
+    }
+
+    return truncated_sectors;
+}
+
+
+int
+mvhd_diff_readv(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt)
+{
+    MVHDIOVec slice[IOV_SLICE_MAX];
+    IOVCursor cur;
+    uint8_t* buff;
+    uint8_t* p;
+    size_t bytes, done;
+    int i, n, ret;
+
+    /* Extents come from all over the chain, so this one goes through a bounce buffer */
+    buff = malloc((size_t)num_sectors * MVHD_SECTOR_SIZE);
+    if (buff == NULL) {
+        return num_sectors;
+    }
+    ret = mvhd_diff_read(vhdm, offset, num_sectors, buff);
+
+    iov_cursor(&cur, iov, iovcnt);
+    p = buff;
+    for (bytes = (size_t)(num_sectors - ret) * MVHD_SECTOR_SIZE; bytes > 0; bytes -= done) {
+        done = iov_take(&cur, bytes, slice, &n);
+        if (done == 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            memcpy(slice[i].base, p, slice[i].len);
+            p += slice[i].len;
+        }
+    }
+    free(buff);
+
+    return ret;
+}
+
+
+int
+mvhd_fixed_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
+{
+    MVHDIOVec iov;
+    IOVCursor cur;
+
+    iov_single(&iov, &cur, in_buff, num_sectors);
+
+    return fixed_xfer(vhdm, offset, num_sectors, &cur, true);
+}
+
+
+int
+mvhd_fixed_writev(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt)
+{
+    IOVCursor cur;
+
+    iov_cursor(&cur, iov, iovcnt);
+
+    return fixed_xfer(vhdm, offset, num_sectors, &cur, true);
+}
+
+
+/**
+ * \brief Check if a write of zeroes to an unallocated block can be skipped
+ * 
+ * An unallocated block of a dynamic image reads as zeroes, and one of a 
+ * differencing image reads whatever its parent has there. If that is all 
+ * zeroes as well, writing zeroes would change nothing but the file size.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset of the write, within a single unallocated block
+ * \param [in] num_sectors The number of sectors to write
+ * \param [in] cur The buffers to write from, which are only looked at
+ * 
+ * \return true if the write can be skipped
+ */
+static bool
+zero_write_is_noop(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const IOVCursor* cur)
+{
+    size_t bytes = (size_t)num_sectors * MVHD_SECTOR_SIZE;
+    uint8_t* par_buff;
+    bool zero;
+
+    if (!iov_is_zero(cur, bytes)) {
+        return false;
+    }
+    if (vhdm->parent == NULL) {
+        return true;
+    }
+
+    /* If we can't check the parent, just do the write */
+    par_buff = malloc(bytes);
+    if (par_buff == NULL) {
+        return false;
+    }
+    vhdm->parent->read_sectors(vhdm->parent, offset, num_sectors, par_buff);
+    zero = mvhd_is_zero(par_buff, bytes);
+    free(par_buff);
+
+    return zero;
+}
+
+
+/**
+ * \brief Write sectors from a scatter/gather list to a dynamic or differencing image
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to write to
+ * \param [in] num_sectors The desired number of sectors to write
+ * \param [in] cur The buffers to write from
+ * 
+ * \return the number of sectors that were not written, or zero
+ */
+static int
+sparse_diff_write_iov(MVHDMeta* vhdm, uint32_t offset, int num_sectors, IOVCursor* cur)
+{
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+
+    MVHDBitmapEntry* ent;
+    int64_t addr;
+    uint32_t s, ls;
+    int blk, sib, lsib, run;
+    bool set;
     ls = offset + transfer_sectors;
-    prev_blk = -1;
 
-    for (s = offset; s < ls; s++) {
+    /* The write is only ever split at block boundaries */
+    for (s = offset; s < ls; s += (lsib - sib)) {
         blk = s / vhdm->sect_per_block;
         sib = s % vhdm->sect_per_block;
-        if (vhdm->bitmap.curr_block != blk && prev_blk >= 0) {            
-            /* Write the sector bitmap for the previous block, before we replace it. */
-            write_curr_sect_bitmap(vhdm);
+        lsib = vhdm->sect_per_block;
+        if ((ls - s) < (uint32_t)(lsib - sib)) {
+            lsib = sib + (int)(ls - s);
+        }
+
+        /* Zeroes don't need a new block, if that's what it reads as already */
+        if (bat_entry(vhdm, blk) == MVHD_SPARSE_BLK && zero_write_is_noop(vhdm, s, lsib - sib, cur)) {
+            iov_skip(cur, (size_t)(lsib - sib) * MVHD_SECTOR_SIZE);
+            continue;
         }
 
-        if (vhdm->block_offset[blk] == MVHD_SPARSE_BLK) {
-            /* "read" the sector bitmap first, before creating a new block, as the bitmap will be
-               zero either way */
-            read_sect_bitmap(vhdm, blk);
+        /* Get the sector bitmap first, before creating a new block, as the bitmap will be
+           zero either way */
+        cache_lock(vhdm);
+        get_sect_bitmap(vhdm, blk);
+        cache_unlock(vhdm);
+        if (bat_entry(vhdm, blk) == MVHD_SPARSE_BLK) {
             create_block(vhdm, blk);
-        } 
+        }
 
-        if (blk != prev_blk) {
-            if (vhdm->bitmap.curr_block != blk) {                
-                read_sect_bitmap(vhdm, blk);
-                mvhd_fseeko64(vhdm->f, (uint64_t)sib * MVHD_SECTOR_SIZE, SEEK_CUR);
-            } else {
-                addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
-                mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
+        addr = ((int64_t)bat_entry(vhdm, blk) + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
+        xfer_iov(&vhdm->f, cur, (size_t)(lsib - sib) * MVHD_SECTOR_SIZE, addr, true, true);
+
+        /* Only mark the sector bitmap dirty if this write changed it. The entry is 
+           looked up again, as another thread may have evicted it in the meantime */
+        cache_lock(vhdm);
+        ent = get_sect_bitmap(vhdm, blk);
+        run = mvhd_bitmap_run_len(ent->bitmap, sib, lsib, &set);
+        if (!set || run != (lsib - sib)) {
+            bitmap_set_range(ent->bitmap, sib, lsib);
+            mark_sect_bitmap_dirty(ent, sib, lsib);
+
+            if (vhdm->owner_map != NULL) {
+                update_block_owner(vhdm, blk, ent->bitmap);
             }
-            prev_blk = blk;
         }
-
-        fwrite(buff, MVHD_SECTOR_SIZE, 1, vhdm->f);
-        VHD_SETBIT(vhdm->bitmap.curr_bitmap, sib);
-        buff += MVHD_SECTOR_SIZE;
+        cache_unlock(vhdm);
     }
 
-    /* And write the sector bitmap for the last block we visited to disk */
-    write_curr_sect_bitmap(vhdm);
+    /* The data goes out first, then any sector bitmaps we modified, unless deferred */
+    mvhd_file_submit(&vhdm->f);
+    if (!vhdm->write_back) {
+        cache_lock(vhdm);
+        mvhd_bitmap_cache_flush(vhdm);
+        cache_unlock(vhdm);
+    }
 
     return truncated_sectors;
 }
 
 
+int
+mvhd_sparse_diff_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
+{
+    MVHDIOVec iov;
+    IOVCursor cur;
+
+    iov_single(&iov, &cur, in_buff, num_sectors);
+
+    return sparse_diff_write_iov(vhdm, offset, num_sectors, &cur);
+}
+
+
+int
+mvhd_sparse_diff_writev(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt)
+{
+    IOVCursor cur;
+
+    iov_cursor(&cur, iov, iovcnt);
+
+    return sparse_diff_write_iov(vhdm, offset, num_sectors, &cur);
+}
+
+
 int
 mvhd_noop_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
 {
@@ -387,3 +1736,417 @@ mvhd_noop_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
 
     return 0;
 }
+
+
+int
+mvhd_noop_writev(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt)
+{
+    (void)vhdm;
+    (void)offset;
+    (void)num_sectors;
+    (void)iov;
+    (void)iovcnt;
+
+    return 0;
+}
+
+
+int
+mvhd_sparse_diff_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
+{
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+
+    MVHDBitmapEntry* ent;
+    uint32_t s, ls;
+    int blk, sib, lsib, run, valid;
+    bool set;
+    ls = offset + transfer_sectors;
+
+    for (s = offset; s < ls; s += (lsib - sib)) {
+        blk = s / vhdm->sect_per_block;
+        sib = s % vhdm->sect_per_block;
+        lsib = vhdm->sect_per_block;
+        if ((ls - s) < (uint32_t)(lsib - sib)) {
+            lsib = sib + (int)(ls - s);
+        }
+
+        if (bat_entry(vhdm, blk) == MVHD_SPARSE_BLK) {
+            /* Nothing to discard */
+            continue;
+        }
+
+        cache_lock(vhdm);
+        ent = get_sect_bitmap(vhdm, blk);
+        run = mvhd_bitmap_run_len(ent->bitmap, sib, lsib, &set);
+        if (set || run != (lsib - sib)) {
+            bitmap_clear_range(ent->bitmap, sib, lsib);
+            mark_sect_bitmap_dirty(ent, sib, lsib);
+
+            /* What's below the child may show through now, so look it up the slow way */
+            if (vhdm->owner_map != NULL && vhdm->owner_map->blocks[blk].kind == MVHD_OWNER_FULL && vhdm->owner_map->blocks[blk].layer == 0) {
+                vhdm->owner_map->blocks[blk].kind = MVHD_OWNER_MIXED;
+            }
+        }
+
+        valid = block_valid_sectors(vhdm, blk);
+        if (mvhd_bitmap_run_len(ent->bitmap, 0, valid, &set) == valid && !set) {
+            /* The block is empty now, so its bitmap needn't be written, only the BAT */
+            ent->dirty = false;
+            free_block(vhdm, blk);
+        }
+        cache_unlock(vhdm);
+    }
+
+    if (!vhdm->write_back) {
+        cache_lock(vhdm);
+        mvhd_bitmap_cache_flush(vhdm);
+        cache_unlock(vhdm);
+    }
+
+    return truncated_sectors;
+}
+
+
+/* One physical piece of a batch, in file order once sorted. */
+typedef struct BatchExt {
+    uint64_t	addr;		/* absolute file offset */
+    uint8_t*	buff;
+    size_t	len;
+    bool	write;
+    int		blk;		/* block whose bitmap is updated by a write, or -1 */
+    int		sib;
+    int		lsib;
+} BatchExt;
+
+
+/* The pieces of a batch that can be issued in any order. */
+typedef struct Batch {
+    MVHDMeta*	vhdm;
+    BatchExt*	ext;
+    int		num;
+    int		size;
+    BitmapSnap	snap;
+} Batch;
+
+
+static int
+batch_add(Batch* b, uint64_t addr, uint8_t* buff, size_t len, bool write, int blk, int sib, int lsib)
+{
+    BatchExt* ext;
+    int size;
+
+    if (b->num == b->size) {
+        size = (b->size > 0) ? b->size * 2 : 64;
+        ext = realloc(b->ext, (size_t)size * sizeof *ext);
+        if (ext == NULL) {
+            return -1;
+        }
+        b->ext = ext;
+        b->size = size;
+    }
+
+    ext = &b->ext[b->num++];
+    ext->addr = addr;
+    ext->buff = buff;
+    ext->len = len;
+    ext->write = write;
+    ext->blk = blk;
+    ext->sib = sib;
+    ext->lsib = lsib;
+
+    return 0;
+}
+
+
+static int
+batch_ext_cmp(const void* a, const void* b)
+{
+    const BatchExt* ea = (const BatchExt*)a;
+    const BatchExt* eb = (const BatchExt*)b;
+
+    if (ea->addr != eb->addr) {
+        return (ea->addr < eb->addr) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * \brief Translate a batch request into physical pieces
+ * 
+ * Sectors that need no I/O on this image (sparse blocks, and data held by a 
+ * parent) are taken care of right away. New blocks are allocated here, but 
+ * their sector bitmaps are only updated once the data is written.
+ * 
+ * \param [in] b The batch to add the pieces to
+ * \param [in] req The request to translate. Its result is set here
+ * 
+ * \return 0 on success, -1 if out of memory
+ */
+static int
+batch_translate(Batch* b, MVHDBatchReq* req)
+{
+    MVHDMeta* vhdm = b->vhdm;
+    uint8_t* buff = (uint8_t*)req->buff;
+    const uint8_t* bitmap;
+    MVHDIOVec one;
+    IOVCursor cur;
+    int64_t addr;
+    uint32_t s, ls, blk_offset;
+    int blk, sib, lsib, i, run;
+    int transfer_sectors, truncated_sectors;
+    bool set;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+
+    check_sectors(req->offset, req->num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    req->result = truncated_sectors;
+
+    if (req->write && vhdm->readonly) {
+        /* Same as mvhd_noop_write() */
+        req->result = 0;
+        return 0;
+    }
+    if (transfer_sectors <= 0) {
+        return 0;
+    }
+
+    if (vhdm->footer.disk_type == MVHD_TYPE_FIXED) {
+        addr = (int64_t)req->offset * MVHD_SECTOR_SIZE;
+        if (vhdm->f.map == NULL) {
+            return batch_add(b, addr, buff, (size_t)transfer_sectors * MVHD_SECTOR_SIZE, req->write != 0, -1, 0, 0);
+        }
+        /* Nothing to seek on a mapped image */
+        if (req->write) {
+            memcpy(vhdm->f.map + addr, buff, (size_t)transfer_sectors * MVHD_SECTOR_SIZE);
+        } else {
+            memcpy(buff, vhdm->f.map + addr, (size_t)transfer_sectors * MVHD_SECTOR_SIZE);
+        }
+        return 0;
+    }
+
+    ls = req->offset + transfer_sectors;
+    for (s = req->offset; s < ls; s += (lsib - sib)) {
+        blk = s / vhdm->sect_per_block;
+        sib = s % vhdm->sect_per_block;
+        lsib = vhdm->sect_per_block;
+        if ((ls - s) < (uint32_t)(lsib - sib)) {
+            lsib = sib + (int)(ls - s);
+        }
+
+        if (req->write) {
+            /* Same order as mvhd_sparse_diff_write() */
+            if (bat_entry(vhdm, blk) == MVHD_SPARSE_BLK) {
+                iov_single(&one, &cur, buff, lsib - sib);
+                if (zero_write_is_noop(vhdm, s, lsib - sib, &cur)) {
+                    buff += (lsib - sib) * MVHD_SECTOR_SIZE;
+                    continue;
+                }
+            }
+
+            cache_lock(vhdm);
+            get_sect_bitmap(vhdm, blk);
+            cache_unlock(vhdm);
+            if (bat_entry(vhdm, blk) == MVHD_SPARSE_BLK) {
+                create_block(vhdm, blk);
+            }
+
+            addr = ((int64_t)bat_entry(vhdm, blk) + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
+            if (batch_add(b, addr, buff, (size_t)(lsib - sib) * MVHD_SECTOR_SIZE, true, blk, sib, lsib) < 0) {
+                return -1;
+            }
+            buff += (lsib - sib) * MVHD_SECTOR_SIZE;
+            continue;
+        }
+
+        blk_offset = bat_entry(vhdm, blk);
+        if (blk_offset == MVHD_SPARSE_BLK) {
+            if (vhdm->parent != NULL) {
+                vhdm->parent->read_sectors(vhdm->parent, s, lsib - sib, buff);
+            } else {
+                memset(buff, 0, (size_t)(lsib - sib) * MVHD_SECTOR_SIZE);
+            }
+            buff += (lsib - sib) * MVHD_SECTOR_SIZE;
+            continue;
+        }
+
+        bitmap = peek_sect_bitmap(vhdm, blk, blk_offset, &b->snap);
+        for (i = sib; i < lsib; i += run) {
+            run = mvhd_bitmap_run_len(bitmap, i, lsib, &set);
+            if (set) {
+                addr = ((int64_t)blk_offset + vhdm->bitmap.sector_count + i) * MVHD_SECTOR_SIZE;
+                if (batch_add(b, addr, buff, (size_t)run * MVHD_SECTOR_SIZE, false, -1, 0, 0) < 0) {
+                    return -1;
+                }
+            } else if (vhdm->parent != NULL) {
+                vhdm->parent->read_sectors(vhdm->parent, s + (i - sib), run, buff);
+            } else {
+                memset(buff, 0, (size_t)run * MVHD_SECTOR_SIZE);
+            }
+            buff += run * MVHD_SECTOR_SIZE;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * \brief Issue the pieces of a batch in file order
+ * 
+ * Pieces that are adjacent in the file (and go in the same direction) are 
+ * merged into a single transfer. Sector bitmaps of written blocks are updated
+ * after the data is out, as in mvhd_sparse_diff_write().
+ * 
+ * \param [in] b The batch to issue. It is empty afterwards
+ */
+static void
+batch_issue(Batch* b)
+{
+    MVHDMeta* vhdm = b->vhdm;
+    MVHDIOVec iov[IOV_SLICE_MAX];
+    MVHDBitmapEntry* ent;
+    BatchExt* e;
+    uint64_t end;
+    bool wrote = false, set;
+    int i, j, n, run;
+
+    if (b->num == 0) {
+        return;
+    }
+    qsort(b->ext, (size_t)b->num, sizeof *b->ext, batch_ext_cmp);
+
+    for (i = 0; i < b->num; i = j) {
+        e = &b->ext[i];
+        iov[0].base = e->buff;
+        iov[0].len = e->len;
+        end = e->addr + e->len;
+        n = 1;
+
+        for (j = i + 1; j < b->num; j++) {
+            if (b->ext[j].write != e->write || b->ext[j].addr != end) {
+                break;
+            }
+            if ((uint8_t*)iov[n - 1].base + iov[n - 1].len == b->ext[j].buff) {
+                /* Adjacent in memory too */
+                iov[n - 1].len += b->ext[j].len;
+            } else if (n < IOV_SLICE_MAX) {
+                iov[n].base = b->ext[j].buff;
+                iov[n++].len = b->ext[j].len;
+            } else {
+                break;
+            }
+            end += b->ext[j].len;
+        }
+
+        if (n == 1) {
+            mvhd_file_queue(&vhdm->f, iov[0].base, iov[0].len, e->addr, e->write);
+        } else if (e->write) {
+            mvhd_file_writev(&vhdm->f, iov, n, e->addr);
+        } else {
+            mvhd_file_readv(&vhdm->f, iov, n, e->addr);
+        }
+    }
+    mvhd_file_submit(&vhdm->f);
+
+    cache_lock(vhdm);
+    for (i = 0; i < b->num; i++) {
+        e = &b->ext[i];
+        if (e->blk < 0) {
+            continue;
+        }
+
+        ent = get_sect_bitmap(vhdm, e->blk);
+        run = mvhd_bitmap_run_len(ent->bitmap, e->sib, e->lsib, &set);
+        if (!set || run != (e->lsib - e->sib)) {
+            bitmap_set_range(ent->bitmap, e->sib, e->lsib);
+            mark_sect_bitmap_dirty(ent, e->sib, e->lsib);
+
+            if (vhdm->owner_map != NULL) {
+                update_block_owner(vhdm, e->blk, ent->bitmap);
+            }
+            wrote = true;
+        }
+    }
+    if (wrote && !vhdm->write_back) {
+        mvhd_bitmap_cache_flush(vhdm);
+    }
+    cache_unlock(vhdm);
+
+    b->num = 0;
+}
+
+
+/**
+ * \brief Check whether two batch requests must be done in order
+ */
+static bool
+batch_conflict(const MVHDBatchReq* a, const MVHDBatchReq* b)
+{
+    uint64_t a_end = (uint64_t)a->offset + (uint64_t)(a->num_sectors > 0 ? a->num_sectors : 0);
+    uint64_t b_end = (uint64_t)b->offset + (uint64_t)(b->num_sectors > 0 ? b->num_sectors : 0);
+
+    if (!a->write && !b->write) {
+        return false;
+    }
+
+    return (a->offset < b_end && b->offset < a_end);
+}
+
+
+int
+mvhd_batch_xfer(MVHDMeta* vhdm, MVHDBatchReq* reqs, int count)
+{
+    Batch b;
+    int first, i, k, failed = 0;
+
+    memset(&b, 0, sizeof b);
+    b.vhdm = vhdm;
+    if (snap_init(vhdm, &b.snap) == -1) {
+        for (i = 0; i < count; i++) {
+            reqs[i].result = reqs[i].num_sectors;
+        }
+        return count;
+    }
+
+    /* Requests are gathered until one depends on an earlier one */
+    first = 0;
+    for (i = 0; i < count; i++) {
+        for (k = first; k < i; k++) {
+            if (batch_conflict(&reqs[k], &reqs[i])) {
+                break;
+            }
+        }
+        if (k < i) {
+            batch_issue(&b);
+            first = i;
+        }
+
+        if (batch_translate(&b, &reqs[i]) < 0) {
+            /* Out of memory. Finish what we have, and do the rest one by one */
+            batch_issue(&b);
+            for (; i < count; i++) {
+                if (reqs[i].write) {
+                    reqs[i].result = vhdm->write_sectors(vhdm, reqs[i].offset, reqs[i].num_sectors, reqs[i].buff);
+                } else {
+                    reqs[i].result = vhdm->read_sectors(vhdm, reqs[i].offset, reqs[i].num_sectors, reqs[i].buff);
+                }
+            }
+            break;
+        }
+    }
+    batch_issue(&b);
+    free(b.ext);
+    snap_free(&b.snap);
+
+    for (i = 0; i < count; i++) {
+        if (reqs[i].result != 0) {
+            failed++;
+        }
+    }
+
+    return failed;
+}
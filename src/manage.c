@@ -68,6 +68,30 @@ int mvhd_errno = 0;
 static char tmp_open_path[MVHD_MAX_PATH_BYTES] = {0};
 
 
+/**
+ * \brief Check for the "conectix" cookie in the footer of an open image file
+ * 
+ * \param [in] f image file to test
+ * 
+ * \return true if the file looks like a VHD
+ */
+static bool
+file_is_vhd(MVHDFile* f)
+{
+    uint8_t con_str[8];
+    int64_t size = mvhd_file_size(f);
+
+    if (size < MVHD_FOOTER_SIZE) {
+        return false;
+    }
+    if (mvhd_read_at(f, con_str, sizeof con_str, size - MVHD_FOOTER_SIZE) < 0) {
+        return false;
+    }
+
+    return mvhd_is_conectix_str(con_str);
+}
+
+
 /**
  * \brief Populate data stuctures with content from a VHD footer
  * 
@@ -78,8 +102,8 @@ read_footer(MVHDMeta* vhdm)
 {
     uint8_t buffer[MVHD_FOOTER_SIZE];
 
-    mvhd_fseeko64(vhdm->f, -MVHD_FOOTER_SIZE, SEEK_END);
-    fread(buffer, sizeof buffer, 1, vhdm->f);
+    vhdm->footer_pos = mvhd_file_size(&vhdm->f) - MVHD_FOOTER_SIZE;
+    mvhd_read_at(&vhdm->f, buffer, sizeof buffer, vhdm->footer_pos);
     mvhd_buffer_to_footer(&vhdm->footer, buffer);
 }
 
@@ -94,8 +118,7 @@ read_sparse_header(MVHDMeta* vhdm)
 {
     uint8_t buffer[MVHD_SPARSE_SIZE];
 
-    mvhd_fseeko64(vhdm->f, vhdm->footer.data_offset, SEEK_SET);
-    fread(buffer, sizeof buffer, 1, vhdm->f);
+    mvhd_read_at(&vhdm->f, buffer, sizeof buffer, vhdm->footer.data_offset);
     mvhd_buffer_to_header(&vhdm->sparse, buffer);
 }
 
@@ -152,10 +175,10 @@ read_bat(MVHDMeta *vhdm, MVHDError* err)
         return -1;
     }
 
-    mvhd_fseeko64(vhdm->f, vhdm->sparse.bat_offset, SEEK_SET);
+    /* The whole table in one go, then fix up the byte order in place */
+    mvhd_read_at(&vhdm->f, vhdm->block_offset, (size_t)vhdm->sparse.max_bat_ent * sizeof *vhdm->block_offset, vhdm->sparse.bat_offset);
 
     for (i = 0; i < vhdm->sparse.max_bat_ent; i++) {
-        fread(&vhdm->block_offset[i], sizeof *vhdm->block_offset, 1, vhdm->f);
         vhdm->block_offset[i] = mvhd_from_be32(vhdm->block_offset[i]);
     }
     return 0;
@@ -181,11 +204,11 @@ calc_sparse_values(MVHDMeta* vhdm)
 
 
 /**
- * \brief Allocate memory for a sector bitmap.
+ * \brief Allocate memory for the sector bitmap cache.
  * 
  * Each data block is preceded by a sector bitmap. Each bit indicates whether the corresponding sector
  * is considered 'clean' or 'dirty' (for sparse VHD images), or whether to read from the parent or current 
- * image (for differencing images).
+ * image (for differencing images). The bitmaps of the most recently used blocks are kept in memory.
  * 
  * \param [in] vhdm MiniVHD data structure
  * \param [out] err this is populated with MVHD_ERR_MEM if the calloc fails
@@ -196,14 +219,11 @@ calc_sparse_values(MVHDMeta* vhdm)
 static int
 init_sector_bitmap(MVHDMeta* vhdm, MVHDError* err)
 {
-    vhdm->bitmap.curr_bitmap = calloc(vhdm->bitmap.sector_count, MVHD_SECTOR_SIZE);
-    if (vhdm->bitmap.curr_bitmap == NULL) {
+    if (mvhd_bitmap_cache_init(vhdm, MVHD_BITMAP_CACHE_DEFAULT) == -1) {
         *err = MVHD_ERR_MEM;
         return -1;
     }
 
-    vhdm->bitmap.curr_block = -1;
-
     return 0;
 }
 
@@ -217,6 +237,7 @@ init_sector_bitmap(MVHDMeta* vhdm, MVHDError* err)
  * Note, this function makes no attempt to verify that the path is the correct 
  * VHD image, or even a VHD image at all.
  * 
+ * \param [in] file the child image, whose storage backend is used to look for the parent
  * \param [in] paths a struct containing all available paths to work with
  * \param [in] the platform code to try and obtain a path for. Setting this to zero 
  * will try using the directory of the child image
@@ -225,9 +246,9 @@ init_sector_bitmap(MVHDMeta* vhdm, MVHDError* err)
  * \retval false if a file is not found
  */
 static bool
-mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code)
+mvhd_parent_path_exists(MVHDFile* file, struct MVHDPaths* paths, uint32_t plat_code)
 {
-    FILE* f;
+    MVHDFile f;
     int ferr;
     size_t cwk_ret;
     enum cwk_path_style style;
@@ -249,12 +270,11 @@ mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code)
         return false;
     }
 
-    f = mvhd_fopen((const char*)paths->joined_path, "rb", &ferr);
-    if (f != NULL) {
+    if (mvhd_file_open(&f, file->ops, file->user, (const char*)paths->joined_path, "rb", &ferr) == 0) {
         /* We found a file at the requested path! */
         memcpy(tmp_open_path, paths->joined_path, (sizeof paths->joined_path) - 1);
         tmp_open_path[sizeof tmp_open_path - 1] = '\0';
-        fclose(f);
+        mvhd_file_close(&f);
         return true;
     }
 
@@ -332,8 +352,7 @@ get_diff_parent_path(MVHDMeta* vhdm, int* err)
             *err = MVHD_ERR_PATH_LEN;
             goto paths_cleanup;
         }
-        mvhd_fseeko64(vhdm->f, vhdm->sparse.par_loc_entry[i].plat_data_offset, SEEK_SET);
-        fread(paths->tmp_src_path, sizeof (uint8_t), utf_inlen, vhdm->f);
+        mvhd_read_at(&vhdm->f, paths->tmp_src_path, utf_inlen, vhdm->sparse.par_loc_entry[i].plat_data_offset);
 
         /* Note, the W2*u parent locators are UTF-16LE, unlike the filename field previously obtained, 
            which is UTF-16BE */
@@ -346,19 +365,19 @@ get_diff_parent_path(MVHDMeta* vhdm, int* err)
 
     /* We have paths in UTF-8. We should have enough info to try and find the parent VHD */
     /* Does the relative path exist? */
-    if (mvhd_parent_path_exists(paths, MVHD_DIF_LOC_W2RU)) {
+    if (mvhd_parent_path_exists(&vhdm->f, paths, MVHD_DIF_LOC_W2RU)) {
         par_fp = tmp_open_path;
         goto paths_cleanup;
     }
 
     /* What about trying the child directory? */
-    if (mvhd_parent_path_exists(paths, 0)) {
+    if (mvhd_parent_path_exists(&vhdm->f, paths, 0)) {
         par_fp = tmp_open_path;
         goto paths_cleanup;
     }
 
     /* Well, all else fails, try the stored absolute path, if it exists */
-    if (mvhd_parent_path_exists(paths, MVHD_DIF_LOC_W2KU)) {
+    if (mvhd_parent_path_exists(&vhdm->f, paths, MVHD_DIF_LOC_W2KU)) {
         par_fp = tmp_open_path;
         goto paths_cleanup;
     }
@@ -391,21 +410,127 @@ assign_io_funcs(MVHDMeta* vhdm)
 	case MVHD_TYPE_FIXED:
 		vhdm->read_sectors = mvhd_fixed_read;
 		vhdm->write_sectors = mvhd_fixed_write;
+		vhdm->readv_sectors = mvhd_fixed_readv;
+		vhdm->writev_sectors = mvhd_fixed_writev;
 		break;
 
 	case MVHD_TYPE_DYNAMIC:
 		vhdm->read_sectors = mvhd_sparse_read;
 		vhdm->write_sectors = mvhd_sparse_diff_write;
+		vhdm->readv_sectors = mvhd_sparse_readv;
+		vhdm->writev_sectors = mvhd_sparse_diff_writev;
 		break;
 
 	case MVHD_TYPE_DIFF:
 		vhdm->read_sectors = mvhd_diff_read;
 		vhdm->write_sectors = mvhd_sparse_diff_write;
+		vhdm->readv_sectors = mvhd_diff_readv;
+		vhdm->writev_sectors = mvhd_sparse_diff_writev;
 		break;
     }
 
-    if (vhdm->readonly)
+    if (vhdm->readonly) {
         vhdm->write_sectors = mvhd_noop_write;
+        vhdm->writev_sectors = mvhd_noop_writev;
+    }
+}
+
+
+/**
+ * \brief Create the locks for thread-safe mode
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \return 0 if successful, -1 if out of memory
+ */
+static int
+locks_create(MVHDMeta* vhdm)
+{
+    MVHDLocks* locks;
+    int i;
+
+    locks = calloc(1, sizeof *locks);
+    if (locks == NULL) {
+        return -1;
+    }
+    vhdm->locks = locks;
+
+    for (i = 0; i < MVHD_LOCK_SHARDS; i++) {
+        if ((locks->shard[i] = mvhd_mutex_create()) == NULL) {
+            return -1;
+        }
+    }
+    locks->cache = mvhd_mutex_create();
+    locks->cache_idle = mvhd_cond_create();
+    locks->end = mvhd_mutex_create();
+    if (locks->cache == NULL || locks->cache_idle == NULL || locks->end == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+locks_free(MVHDMeta* vhdm)
+{
+    int i;
+
+    if (vhdm->locks == NULL) {
+        return;
+    }
+
+    for (i = 0; i < MVHD_LOCK_SHARDS; i++) {
+        mvhd_mutex_destroy(vhdm->locks->shard[i]);
+    }
+    mvhd_mutex_destroy(vhdm->locks->cache);
+    mvhd_cond_destroy(vhdm->locks->cache_idle);
+    mvhd_mutex_destroy(vhdm->locks->end);
+    free(vhdm->locks);
+    vhdm->locks = NULL;
+}
+
+
+/**
+ * \brief Lock or unlock the block shards covering a sector range
+ * 
+ * Only writers take shards; readers go without. Shards are always taken in 
+ * the same order, so two requests can not deadlock. A fixed VHD has no 
+ * metadata that changes on reads or writes, so nothing is locked for it.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset The first sector of the range
+ * \param [in] num_sectors The number of sectors in the range, or -1 for all of the VHD
+ * \param [in] lock true to lock, false to unlock
+ */
+static void
+lock_blocks(MVHDMeta* vhdm, uint32_t offset, int num_sectors, bool lock)
+{
+    uint32_t first, count;
+    int i;
+
+    if (vhdm->locks == NULL || vhdm->footer.disk_type == MVHD_TYPE_FIXED) {
+        return;
+    }
+
+    if (num_sectors < 0) {
+        first = 0;
+        count = MVHD_LOCK_SHARDS;
+    } else {
+        first = offset / vhdm->sect_per_block;
+        count = (offset + (uint32_t)(num_sectors > 0 ? num_sectors - 1 : 0)) / vhdm->sect_per_block - first + 1;
+    }
+
+    for (i = 0; i < MVHD_LOCK_SHARDS; i++) {
+        if (((uint32_t)i + MVHD_LOCK_SHARDS - first % MVHD_LOCK_SHARDS) % MVHD_LOCK_SHARDS >= count) {
+            continue;
+        }
+        if (lock) {
+            mvhd_mutex_lock(vhdm->locks->shard[i]);
+        } else {
+            mvhd_mutex_unlock(vhdm->locks->shard[i]);
+        }
+    }
 }
 
 
@@ -503,6 +628,19 @@ mvhd_calculate_geometry(uint64_t size)
 MVHDAPI MVHDMeta *
 mvhd_open(const char* path, int readonly, int* err)
 {
+    MVHDOpenOptions options;
+
+    memset(&options, 0, sizeof options);
+    options.readonly = readonly;
+
+    return mvhd_open_ex(path, options, err);
+}
+
+
+MVHDAPI MVHDMeta *
+mvhd_open_ex(const char* path, MVHDOpenOptions options, int* err)
+{
+    MVHDOpenOptions par_options;
     MVHDError open_err;
 
     MVHDMeta *vhdm = calloc(sizeof *vhdm, 1);
@@ -519,18 +657,21 @@ mvhd_open(const char* path, int readonly, int* err)
     //This is safe, as we've just checked for potential overflow above
     strcpy(vhdm->filename, path);
 
-    if (readonly) {
-	vhdm->f = mvhd_fopen((const char*)vhdm->filename, "rb", err);
-    } else {
-	vhdm->f = mvhd_fopen((const char*)vhdm->filename, "rb+", err);
-    }
-    if (vhdm->f == NULL) {
+    if (mvhd_file_open(&vhdm->f, options.io_ops, options.io_user, (const char*)vhdm->filename, options.readonly ? "rb" : "rb+", err) < 0) {
         /* note, mvhd_fopen sets err for us */
         goto cleanup_vhdm;
     }
-    vhdm->readonly = readonly;
+    vhdm->readonly = options.readonly;
+    if (options.thread_safe && locks_create(vhdm) == -1) {
+        *err = MVHD_ERR_MEM;
+        goto cleanup_file;
+    }
+    if (options.io_uring && !options.thread_safe) {
+        /* Not fatal if this fails, we then just use normal file I/O */
+        mvhd_file_enable_ring(&vhdm->f);
+    }
 
-    if (! mvhd_file_is_vhd(vhdm->f)) {
+    if (! file_is_vhd(&vhdm->f)) {
         *err = MVHD_ERR_NOT_VHD;
         goto cleanup_file;
     }
@@ -555,9 +696,23 @@ mvhd_open(const char* path, int readonly, int* err)
             *err = open_err;
             goto cleanup_bat;
         }
+        if (options.write_back && !options.readonly) {
+            vhdm->bat_dirty = calloc((vhdm->sparse.max_bat_ent + MVHD_BAT_ENT_PER_SECT - 1) / MVHD_BAT_ENT_PER_SECT, 1);
+            if (vhdm->bat_dirty == NULL) {
+                *err = MVHD_ERR_MEM;
+                goto cleanup_bitmap;
+            }
+            vhdm->write_back = true;
+        }
+        if (!options.readonly) {
+            mvhd_free_space_init(vhdm);
+        }
     } else if (vhdm->footer.disk_type != MVHD_TYPE_FIXED) {
         *err = MVHD_ERR_TYPE;
         goto cleanup_bitmap;
+    } else if (options.memory_map && vhdm->footer.curr_sz <= (uint64_t)vhdm->footer_pos) {
+        /* Not fatal if this fails, we then just use normal file I/O */
+        mvhd_file_map(&vhdm->f, vhdm->footer.curr_sz, !options.readonly);
     }
     assign_io_funcs(vhdm);
 
@@ -574,17 +729,28 @@ mvhd_open(const char* path, int readonly, int* err)
             goto cleanup_format_buff;
         }
 
-        uint32_t par_mod_ts = mvhd_file_mod_timestamp(par_path, err);
-        if (*err != 0) {
-            goto cleanup_format_buff;
+        /* Only regular files have a last-modified timestamp we can check */
+        if (vhdm->f.ops == mvhd_default_io_ops()) {
+            uint32_t par_mod_ts = mvhd_file_mod_timestamp(par_path, err);
+            if (*err != 0) {
+                goto cleanup_format_buff;
+            }
+
+            if (vhdm->sparse.par_timestamp != par_mod_ts) {
+                /* The last-modified timestamp is to fragile to make this a fatal error.
+                   Instead, we inform the caller of the potential problem. */
+                *err = MVHD_ERR_TIMESTAMP;
+            }
         }
 
-        if (vhdm->sparse.par_timestamp != par_mod_ts) {
-            /* The last-modified timestamp is to fragile to make this a fatal error.
-               Instead, we inform the caller of the potential problem. */
-            *err = MVHD_ERR_TIMESTAMP;
-        }
-        vhdm->parent = mvhd_open(par_path, true, err);
+        /* The parent lives in the same storage as its child */
+        memset(&par_options, 0, sizeof par_options);
+        par_options.readonly = 1;
+        par_options.io_uring = options.io_uring;
+        par_options.io_ops = options.io_ops;
+        par_options.io_user = options.io_user;
+        par_options.thread_safe = options.thread_safe;
+        vhdm->parent = mvhd_open_ex(par_path, par_options, err);
         if (vhdm->parent == NULL) {
             goto cleanup_format_buff;
         }
@@ -593,6 +759,11 @@ mvhd_open(const char* path, int readonly, int* err)
             *err = MVHD_ERR_INVALID_PAR_UUID;
             goto cleanup_format_buff;
         }
+
+        if (options.owner_map && mvhd_owner_map_init(vhdm) == -1) {
+            *err = MVHD_ERR_MEM;
+            goto cleanup_format_buff;
+        }
     }
 
     /*
@@ -606,16 +777,18 @@ cleanup_format_buff:
     vhdm->format_buffer.zero_data = NULL;
 
 cleanup_bitmap:
-    free(vhdm->bitmap.curr_bitmap);
-    vhdm->bitmap.curr_bitmap = NULL;
+    mvhd_free_space_free(vhdm);
+    mvhd_bitmap_cache_free(vhdm);
+    free(vhdm->bat_dirty);
+    vhdm->bat_dirty = NULL;
 
 cleanup_bat:
     free(vhdm->block_offset);
     vhdm->block_offset = NULL;
 
 cleanup_file:
-    fclose(vhdm->f);
-    vhdm->f = NULL;
+    mvhd_file_close(&vhdm->f);
+    locks_free(vhdm);
 
 cleanup_vhdm:
     free(vhdm);
@@ -626,35 +799,172 @@ end:
 }
 
 
+MVHDAPI MVHDMeta *
+mvhd_dup(MVHDMeta* vhdm, int* err)
+{
+    MVHDMeta* dup;
+
+    if (vhdm == NULL || !vhdm->readonly) {
+        *err = MVHD_ERR_INVALID_PARAMS;
+        return NULL;
+    }
+
+    dup = malloc(sizeof *dup);
+    if (dup == NULL) {
+        *err = MVHD_ERR_MEM;
+        goto end;
+    }
+
+    /*
+     * Start out sharing everything, then give the duplicate its own file, 
+     * caches and parents. The BAT, headers and zero buffer never change on 
+     * a read-only image, so those stay shared.
+     */
+    *dup = *vhdm;
+    dup->origin = (vhdm->origin != NULL) ? vhdm->origin : vhdm;
+    memset(&dup->f, 0, sizeof dup->f);
+    dup->parent = NULL;
+    dup->owner_map = NULL;
+    dup->async = NULL;
+    dup->locks = NULL;
+    dup->bitmap.entries = NULL;
+    dup->bitmap.data = NULL;
+    dup->bitmap.num_entries = 0;
+    dup->bitmap.hits = 0;
+    dup->bitmap.misses = 0;
+    memset(&dup->free_space, 0, sizeof dup->free_space);
+
+    if (mvhd_file_open(&dup->f, vhdm->f.ops, vhdm->f.user, (const char*)dup->filename, "rb", err) < 0) {
+        goto cleanup_dup;
+    }
+    if (vhdm->f.map != NULL) {
+        /* Not fatal if this fails, we then just use normal file I/O */
+        mvhd_file_map(&dup->f, vhdm->f.map_size, false);
+    }
+    if (vhdm->f.ring != NULL) {
+        mvhd_file_enable_ring(&dup->f);
+    }
+    if (vhdm->locks != NULL && locks_create(dup) == -1) {
+        *err = MVHD_ERR_MEM;
+        goto cleanup_file;
+    }
+
+    if (vhdm->footer.disk_type != MVHD_TYPE_FIXED && mvhd_bitmap_cache_init(dup, vhdm->bitmap.num_entries) == -1) {
+        *err = MVHD_ERR_MEM;
+        goto cleanup_file;
+    }
+
+    if (vhdm->parent != NULL) {
+        dup->parent = mvhd_dup(vhdm->parent, err);
+        if (dup->parent == NULL) {
+            goto cleanup_bitmap;
+        }
+    }
+
+    if (vhdm->owner_map != NULL && mvhd_owner_map_share(dup, vhdm->owner_map) == -1) {
+        *err = MVHD_ERR_MEM;
+        goto cleanup_parent;
+    }
+
+    goto end;
+
+cleanup_parent:
+    mvhd_close(dup->parent);
+
+cleanup_bitmap:
+    mvhd_bitmap_cache_free(dup);
+
+cleanup_file:
+    mvhd_file_close(&dup->f);
+    locks_free(dup);
+
+cleanup_dup:
+    free(dup);
+    dup = NULL;
+
+end:
+    return dup;
+}
+
+
 MVHDAPI void
 mvhd_close(MVHDMeta* vhdm)
 {
     if (vhdm == NULL)
 	return;
 
+    /* Let any asynchronous requests finish first */
+    mvhd_async_free(vhdm);
+    mvhd_owner_map_free(vhdm);
+
     if (vhdm->parent != NULL) {
         mvhd_close(vhdm->parent);
     }
 
-    fclose(vhdm->f);
+    /* Any modified sector bitmaps and BAT entries must hit the disk before we go */
+    mvhd_bitmap_cache_free(vhdm);
+    if (vhdm->bat_dirty != NULL) {
+        mvhd_bat_flush(vhdm);
+        free(vhdm->bat_dirty);
+        vhdm->bat_dirty = NULL;
+    }
+
+    mvhd_file_close(&vhdm->f);
 
+    /* A duplicate doesn't own its BAT and zero buffer */
+    if (vhdm->origin != NULL) {
+        vhdm->block_offset = NULL;
+        vhdm->format_buffer.zero_data = NULL;
+    }
+    mvhd_free_space_free(vhdm);
     if (vhdm->block_offset != NULL) {
         free(vhdm->block_offset);
         vhdm->block_offset = NULL;
     }
-    if (vhdm->bitmap.curr_bitmap != NULL) {
-        free(vhdm->bitmap.curr_bitmap);
-        vhdm->bitmap.curr_bitmap = NULL;
-    }
     if (vhdm->format_buffer.zero_data != NULL) {
         free(vhdm->format_buffer.zero_data);
         vhdm->format_buffer.zero_data = NULL;
     }
+    locks_free(vhdm);
 
     free(vhdm);
 }
 
 
+MVHDAPI int
+mvhd_flush(MVHDMeta* vhdm)
+{
+    int ret = 0;
+
+    if (vhdm->readonly) {
+        return 0;
+    }
+
+    lock_blocks(vhdm, 0, -1, true);
+
+    /* Sector bitmaps first, then the BAT entries that point at their blocks */
+    if (vhdm->bitmap.entries != NULL) {
+        /* Readers may still be using the cache */
+        if (vhdm->locks != NULL) {
+            mvhd_mutex_lock(vhdm->locks->cache);
+        }
+        mvhd_bitmap_cache_flush(vhdm);
+        if (vhdm->locks != NULL) {
+            mvhd_mutex_unlock(vhdm->locks->cache);
+        }
+        mvhd_bat_flush(vhdm);
+    }
+
+    if (mvhd_file_flush(&vhdm->f) != 0) {
+        ret = -1;
+    }
+
+    lock_blocks(vhdm, 0, -1, false);
+
+    return ret;
+}
+
+
 MVHDAPI int
 mvhd_diff_update_par_timestamp(MVHDMeta* vhdm, int* err)
 {
@@ -683,13 +993,314 @@ mvhd_diff_update_par_timestamp(MVHDMeta* vhdm, int* err)
 
     /* Generate and write the updated sparse header */
     mvhd_header_to_buffer(&vhdm->sparse, sparse_buff);
-    mvhd_fseeko64(vhdm->f, (int64_t)vhdm->footer.data_offset, SEEK_SET);
-    fwrite(sparse_buff, sizeof sparse_buff, 1, vhdm->f);
+    mvhd_write_at(&vhdm->f, sparse_buff, sizeof sparse_buff, vhdm->footer.data_offset);
+
+    return 0;
+}
+
+
+/* Shared state of the threads committing a differencing image */
+typedef struct MVHDCommit {
+    MVHDMeta*	child;
+    MVHDMeta*	par;
+    MVHDMutex*	lock;
+    MVHDCond*	done;
+    uint32_t	next_blk;	/* next block of the child to commit */
+    int		running;	/* number of threads still committing */
+    int		err;
+} MVHDCommit;
+
+
+/**
+ * \brief Write the sectors present in one block of a differencing image to its parent
+ * 
+ * The bitmap and data of the block are read in one go, and every run of present
+ * sectors is written to the parent with a single request.
+ * 
+ * \param [in] cm commit state
+ * \param [in] blk block number
+ * \param [in] buff buffer large enough for the sector bitmap and data of a block
+ * 
+ * \return 0 if successful, an MVHDError otherwise
+ */
+static int
+commit_block(MVHDCommit* cm, uint32_t blk, uint8_t* buff)
+{
+    MVHDMeta* child = cm->child;
+    uint8_t* data = buff + ((size_t)child->bitmap.sector_count * MVHD_SECTOR_SIZE);
+    uint32_t first = blk * (uint32_t)child->sect_per_block;
+    uint32_t total = (uint32_t)(child->footer.curr_sz / MVHD_SECTOR_SIZE);
+    int n = child->sect_per_block;
+    int s, run;
+    bool set;
+
+    if (child->block_offset[blk] == MVHD_SPARSE_BLK) {
+        return 0;
+    }
+    if (first + (uint32_t)n > total) {
+        n = (int)(total - first);
+    }
+    if (mvhd_read_at(&child->f, buff, (size_t)(child->bitmap.sector_count + child->sect_per_block) * MVHD_SECTOR_SIZE,
+                     (uint64_t)child->block_offset[blk] * MVHD_SECTOR_SIZE) != 0) {
+        return MVHD_ERR_FILE;
+    }
+
+    for (s = 0; s < n; s += run) {
+        run = mvhd_bitmap_run_len(buff, s, n, &set);
+        if (set && mvhd_write_sectors(cm->par, first + (uint32_t)s, run, data + ((size_t)s * MVHD_SECTOR_SIZE)) != 0) {
+            return MVHD_ERR_FILE;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * \brief Commit blocks until there are none left, or an error occurred
+ */
+static void
+commit_worker(void* arg)
+{
+    MVHDCommit* cm = arg;
+    uint8_t* buff;
+    uint32_t blk;
+    int ret = 0;
+
+    buff = malloc((size_t)(cm->child->bitmap.sector_count + cm->child->sect_per_block) * MVHD_SECTOR_SIZE);
+    if (buff == NULL) {
+        ret = MVHD_ERR_MEM;
+    }
+
+    for (;;) {
+        mvhd_mutex_lock(cm->lock);
+        if (ret != 0 && cm->err == 0) {
+            cm->err = ret;
+        }
+        if (cm->err != 0 || cm->next_blk >= cm->child->sparse.max_bat_ent) {
+            break;
+        }
+        blk = cm->next_blk++;
+        mvhd_mutex_unlock(cm->lock);
+
+        ret = commit_block(cm, blk, buff);
+    }
+
+    /* Still holding the lock here */
+    cm->running--;
+    mvhd_cond_signal(cm->done);
+    mvhd_mutex_unlock(cm->lock);
+
+    free(buff);
+}
+
+
+/**
+ * \brief Open the parent of a differencing image again, after it was changed
+ * 
+ * The old parent is only closed once the new one is open, so vhdm is left 
+ * as it was if this fails.
+ * 
+ * \param [in] vhdm Differencing VHD whose parent is reopened
+ * \param [out] err MVHD_ERR_MEM, or whatever mvhd_open_ex() reported
+ * 
+ * \return 0 if successful, -1 otherwise
+ */
+static int
+reopen_parent(MVHDMeta* vhdm, int* err)
+{
+    MVHDOpenOptions options;
+    MVHDMeta* old_par = vhdm->parent;
+    MVHDMeta* par;
+    bool had_map;
+
+    /* Same options as mvhd_open_ex() used for the parent */
+    memset(&options, 0, sizeof options);
+    options.readonly = 1;
+    options.io_uring = old_par->f.ring != NULL;
+    options.io_ops = vhdm->f.ops;
+    options.io_user = vhdm->f.user;
+    options.thread_safe = vhdm->locks != NULL;
+    par = mvhd_open_ex(old_par->filename, options, err);
+    if (par == NULL) {
+        return -1;
+    }
+    *err = 0;
+
+    if (par->footer.disk_type != MVHD_TYPE_FIXED && 
+        mvhd_set_bitmap_cache_size(par, old_par->bitmap.num_entries, err) == -1) {
+        mvhd_close(par);
+        return -1;
+    }
+
+    had_map = vhdm->owner_map != NULL;
+    mvhd_owner_map_free(vhdm);
+    vhdm->parent = par;
+    mvhd_close(old_par);
+
+    if (had_map && mvhd_owner_map_init(vhdm) == -1) {
+        *err = MVHD_ERR_MEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+MVHDAPI int
+mvhd_diff_commit(MVHDMeta* vhdm, int num_threads, int* err)
+{
+    MVHDOpenOptions options;
+    MVHDCommit cm;
+    int i, ret = -1;
+
+    if (vhdm == NULL || err == NULL) {
+        if (err != NULL)
+            *err = MVHD_ERR_INVALID_PARAMS;
+        return -1;
+    }
+    if (vhdm->footer.disk_type != MVHD_TYPE_DIFF) {
+        *err = MVHD_ERR_TYPE;
+        return -1;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    /* The sector bitmaps are read from the file, so write back any cached ones */
+    if (!vhdm->readonly && mvhd_flush(vhdm) != 0) {
+        *err = MVHD_ERR_FILE;
+        return -1;
+    }
+
+    memset(&cm, 0, sizeof cm);
+    cm.child = vhdm;
+
+    /* Open the parent once more, this time for writing */
+    memset(&options, 0, sizeof options);
+    options.thread_safe = num_threads > 1;
+    options.io_ops = vhdm->f.ops;
+    options.io_user = vhdm->f.user;
+    cm.par = mvhd_open_ex(vhdm->parent->filename, options, err);
+    if (cm.par == NULL) {
+        return -1;
+    }
+    *err = 0;
+
+    cm.lock = mvhd_mutex_create();
+    cm.done = mvhd_cond_create();
+    if (cm.lock == NULL || cm.done == NULL) {
+        *err = MVHD_ERR_MEM;
+        goto cleanup_par;
+    }
+
+    /* The calling thread does its share of the work as well */
+    cm.running = 1;
+    for (i = 1; i < num_threads; i++) {
+        mvhd_mutex_lock(cm.lock);
+        cm.running++;
+        mvhd_mutex_unlock(cm.lock);
+        if (mvhd_thread_start(commit_worker, &cm) < 0) {
+            mvhd_mutex_lock(cm.lock);
+            cm.running--;
+            mvhd_mutex_unlock(cm.lock);
+            break;
+        }
+    }
+    commit_worker(&cm);
+
+    mvhd_mutex_lock(cm.lock);
+    while (cm.running > 0) {
+        mvhd_cond_wait(cm.done, cm.lock);
+    }
+    mvhd_mutex_unlock(cm.lock);
+
+    if (cm.err != 0) {
+        *err = cm.err;
+        goto cleanup_par;
+    }
+    ret = 0;
+
+cleanup_par:
+    if (cm.done != NULL) {
+        mvhd_cond_destroy(cm.done);
+    }
+    if (cm.lock != NULL) {
+        mvhd_mutex_destroy(cm.lock);
+    }
+    mvhd_close(cm.par);
+
+    /* Our own handle of the parent still has the old BAT and sector bitmaps */
+    if (ret == 0) {
+        ret = reopen_parent(vhdm, err);
+    }
+
+    /* The parent has changed, but the child still reads the same */
+    if (ret == 0 && !vhdm->readonly) {
+        if (vhdm->f.ops == mvhd_default_io_ops()) {
+            ret = mvhd_diff_update_par_timestamp(vhdm, err);
+        } else {
+            /* Only regular files have a last-modified timestamp to record */
+            *err = MVHD_ERR_TIMESTAMP;
+        }
+    }
+
+    return ret;
+}
+
+
+MVHDAPI int
+mvhd_set_bitmap_cache_size(MVHDMeta* vhdm, int num_blocks, int* err)
+{
+    MVHDMeta* curr_vhdm;
+    int ret;
+
+    if (vhdm == NULL || err == NULL || num_blocks < 1) {
+        if (err != NULL)
+            *err = MVHD_ERR_INVALID_PARAMS;
+        return -1;
+    }
+    if (vhdm->footer.disk_type == MVHD_TYPE_FIXED) {
+        *err = MVHD_ERR_TYPE;
+        return -1;
+    }
+
+    /* Parents are opened by us, so size their caches along with the child */
+    for (curr_vhdm = vhdm; curr_vhdm != NULL; curr_vhdm = curr_vhdm->parent) {
+        if (curr_vhdm->footer.disk_type == MVHD_TYPE_FIXED) {
+            continue;
+        }
+        if (curr_vhdm->locks != NULL) {
+            mvhd_mutex_lock(curr_vhdm->locks->cache);
+        }
+        ret = mvhd_bitmap_cache_init(curr_vhdm, num_blocks);
+        if (curr_vhdm->locks != NULL) {
+            mvhd_mutex_unlock(curr_vhdm->locks->cache);
+        }
+        if (ret == -1) {
+            *err = MVHD_ERR_MEM;
+            return -1;
+        }
+    }
 
     return 0;
 }
 
 
+MVHDAPI void
+mvhd_get_bitmap_cache_stats(MVHDMeta* vhdm, uint64_t* hits, uint64_t* misses)
+{
+    MVHDMeta* curr_vhdm;
+
+    *hits = *misses = 0;
+
+    for (curr_vhdm = vhdm; curr_vhdm != NULL; curr_vhdm = curr_vhdm->parent) {
+        *hits += curr_vhdm->bitmap.hits;
+        *misses += curr_vhdm->bitmap.misses;
+    }
+}
+
+
 MVHDAPI int
 mvhd_read_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff)
 {
@@ -700,7 +1311,104 @@ mvhd_read_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_bu
 MVHDAPI int
 mvhd_write_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
 {
-    return vhdm->write_sectors(vhdm, offset, num_sectors, in_buff);
+    int ret;
+
+    lock_blocks(vhdm, offset, num_sectors, true);
+    ret = vhdm->write_sectors(vhdm, offset, num_sectors, in_buff);
+    lock_blocks(vhdm, offset, num_sectors, false);
+
+    return ret;
+}
+
+
+/**
+ * \brief Limit a sector count to the whole sectors that fit in a scatter/gather list
+ * 
+ * \return The number of sectors that can be transferred
+ */
+static int
+iov_sectors(const MVHDIOVec* iov, int iovcnt, int num_sectors)
+{
+    uint64_t bytes = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        bytes += iov[i].len;
+    }
+    if (num_sectors > 0 && bytes / MVHD_SECTOR_SIZE < (uint64_t)num_sectors) {
+        num_sectors = (int)(bytes / MVHD_SECTOR_SIZE);
+    }
+
+    return num_sectors;
+}
+
+
+MVHDAPI int
+mvhd_readv_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt)
+{
+    int n = iov_sectors(iov, iovcnt, num_sectors);
+
+    return vhdm->readv_sectors(vhdm, offset, n, iov, iovcnt) + (num_sectors - n);
+}
+
+
+MVHDAPI int
+mvhd_writev_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt)
+{
+    int n = iov_sectors(iov, iovcnt, num_sectors);
+    int ret;
+
+    lock_blocks(vhdm, offset, n, true);
+    ret = vhdm->writev_sectors(vhdm, offset, n, iov, iovcnt);
+    lock_blocks(vhdm, offset, n, false);
+
+    return ret + (num_sectors - n);
+}
+
+
+MVHDAPI int
+mvhd_submit_batch(MVHDMeta* vhdm, MVHDBatchReq* reqs, int count)
+{
+    bool write = false;
+    int i, ret;
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    /* A batch that writes can go anywhere, so it holds all of the VHD */
+    for (i = 0; i < count; i++) {
+        if (reqs[i].write) {
+            write = true;
+        }
+    }
+    if (write) {
+        lock_blocks(vhdm, 0, -1, true);
+    }
+    ret = mvhd_batch_xfer(vhdm, reqs, count);
+    if (write) {
+        lock_blocks(vhdm, 0, -1, false);
+    }
+
+    return ret;
+}
+
+
+MVHDAPI int
+mvhd_discard_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
+{
+    int ret;
+
+    /* A fixed image has no space to give back, and a read-only one may not */
+    if (vhdm->footer.disk_type == MVHD_TYPE_FIXED || vhdm->readonly) {
+        return 0;
+    }
+
+    lock_blocks(vhdm, offset, num_sectors, true);
+    ret = mvhd_sparse_diff_discard(vhdm, offset, num_sectors);
+    lock_blocks(vhdm, offset, num_sectors, false);
+
+    return ret;
 }
 
 
@@ -709,8 +1417,11 @@ mvhd_format_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
 {
     int num_full = num_sectors / vhdm->format_buffer.sector_count;
     int remain = num_sectors % vhdm->format_buffer.sector_count;
+    uint32_t start = offset;
     int i;
 
+    lock_blocks(vhdm, start, num_sectors, true);
+
     for (i = 0; i < num_full; i++) {
         vhdm->write_sectors(vhdm, offset, vhdm->format_buffer.sector_count, vhdm->format_buffer.zero_data);
         offset += vhdm->format_buffer.sector_count;
@@ -718,6 +1429,8 @@ mvhd_format_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
 
     vhdm->write_sectors(vhdm, offset, remain, vhdm->format_buffer.zero_data);
 
+    lock_blocks(vhdm, start, num_sectors, false);
+
     return 0;
 }
 
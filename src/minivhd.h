@@ -91,6 +91,69 @@ extern "C" {
 
 typedef void (*mvhd_progress_callback)(uint32_t current_sector, uint32_t total_sectors);
 
+typedef struct MVHDMeta MVHDMeta;
+
+typedef void (*mvhd_async_callback)(MVHDMeta* vhdm, int result, void* user_data);
+
+typedef enum MVHDIOHint {
+    MVHD_HINT_NORMAL = 0,	/**< No particular access pattern */
+    MVHD_HINT_SEQUENTIAL,	/**< The range will be accessed sequentially */
+    MVHD_HINT_RANDOM,		/**< The range will be accessed randomly */
+    MVHD_HINT_WILLNEED,		/**< The range will be accessed soon */
+    MVHD_HINT_DONTNEED		/**< The range will not be accessed again soon */
+} MVHDIOHint;
+
+/**
+ * One buffer of a scatter/gather list, as used by mvhd_readv_sectors().
+ */
+typedef struct MVHDIOVec {
+    void* base; /** Start of the buffer */
+    size_t len; /** Length of the buffer in bytes */
+} MVHDIOVec;
+
+/**
+ * One request of a batch, see mvhd_submit_batch().
+ */
+typedef struct MVHDBatchReq {
+    uint32_t offset; /** Sector offset to start at */
+    int num_sectors; /** The number of sectors to transfer */
+    void* buff; /** Buffer to read sector data into, or to write it from */
+    int write; /** Non-zero to write, zero to read */
+    int result; /** Set to the number of sectors that were not transferred, or zero */
+} MVHDBatchReq;
+
+/**
+ * A storage backend for VHD files.
+ * 
+ * All image files (including the parents of a differencing VHD) are accessed 
+ * through these functions. A backend context is created by open(), and passed
+ * to all the other functions. Offsets are absolute byte offsets in the file.
+ */
+typedef struct MVHDIOOps {
+    /** Open the file at path. mode is "rb", "rb+" or "wb+", as for fopen(). Returns the context, or NULL with err set to MVHD_ERR_FILE (or another MVHDError) */
+    void* (*open)(void* user, const char* path, const char* mode, int* err);
+    /** Close the file and free the context */
+    void (*close)(void* ctx);
+    /** Read size bytes at offset. Returns 0 if all bytes were read, -1 otherwise; any bytes that could not be read must be zeroed */
+    int (*read_at)(void* ctx, void* buffer, size_t size, uint64_t offset);
+    /** Write size bytes at offset. Returns 0 if all bytes were written, -1 otherwise */
+    int (*write_at)(void* ctx, const void* buffer, size_t size, uint64_t offset);
+    /** Returns the current size of the file in bytes, or -1 on error */
+    int64_t (*size)(void* ctx);
+    /** Optional; set the size of the file, zero filling when it grows. Returns 0 on success, -1 otherwise */
+    int (*truncate)(void* ctx, uint64_t size);
+    /** Optional; make all written data durable. Returns 0 on success, -1 otherwise */
+    int (*flush)(void* ctx);
+    /** Optional; advise the backend about the upcoming access to a range (size 0 means up to the end of file). hint is one of MVHDIOHint */
+    void (*hint)(void* ctx, uint64_t offset, uint64_t size, int hint);
+    /** Optional; read into iovcnt buffers, filled in order from offset. Same rules as read_at */
+    int (*readv_at)(void* ctx, const MVHDIOVec* iov, int iovcnt, uint64_t offset);
+    /** Optional; write iovcnt buffers, in order from offset. Same rules as write_at */
+    int (*writev_at)(void* ctx, const MVHDIOVec* iov, int iovcnt, uint64_t offset);
+    /** Optional; make size bytes at offset read as zeroes, without changing the file size. Returns 0 on success, -1 otherwise, in which case zeroes are written */
+    int (*zero_at)(void* ctx, uint64_t offset, uint64_t size);
+} MVHDIOOps;
+
 typedef struct MVHDCreationOptions {
     int type; /** MVHD_TYPE_FIXED, MVHD_TYPE_DYNAMIC, or MVHD_TYPE_DIFF */
     char* path; /** Absolute path of the new VHD file */
@@ -99,9 +162,20 @@ typedef struct MVHDCreationOptions {
     MVHDGeom geometry; /** The geometry of the VHD. If set to 0, the geometry is auto-calculated from the size_in_bytes field. */
     uint32_t block_size_in_sectors; /** MVHD_BLOCK_LARGE or MVHD_BLOCK_SMALL, or 0 for the default value. The number of sectors per block. */
     mvhd_progress_callback progress_callback; /** Optional; if not NULL, gets called to indicate progress on the creation operation. Only applies to MVHD_TYPE_FIXED. */
+    const MVHDIOOps* io_ops; /** Optional; if not NULL, the storage backend used to create the VHD (and open its parent). Otherwise, regular files are used. */
+    void* io_user; /** Passed to io_ops->open() */
 } MVHDCreationOptions;
 
-typedef struct MVHDMeta MVHDMeta;
+typedef struct MVHDOpenOptions {
+    int readonly; /** Set this to 1 to open the VHD in a read only manner */
+    int owner_map; /** For MVHD_TYPE_DIFF, set this to 1 to index which image in the chain owns each block when opening. Reads of blocks that are not partially written in several images then bypass the sector bitmaps. */
+    int write_back; /** For sparse and differencing VHDs, set this to 1 to defer writing sector bitmaps and BAT entries until they are evicted from the cache, mvhd_flush() is called, or the VHD is closed. */
+    int memory_map; /** For MVHD_TYPE_FIXED, set this to 1 to memory map the image data, so reads and writes become plain memory copies. If the mapping cannot be created, normal file I/O is used. Only available with the default storage backend. */
+    int io_uring; /** On Linux, set this to 1 to submit the block data, sector bitmap and BAT I/O of each read or write request as one io_uring batch. If io_uring is not available, normal file I/O is used. Only available with the default storage backend. */
+    const MVHDIOOps* io_ops; /** Optional; if not NULL, the storage backend used to access the VHD and its parents. Otherwise, regular files are used. */
+    void* io_user; /** Passed to io_ops->open() */
+    int thread_safe; /** Set this to 1 to allow the VHD to be used from several threads at the same time. Reads go ahead while writes are in progress, and a write only waits for other writes to the same blocks. A read that overlaps a write in progress may return the old or the new data of each sector. io_uring is not used in this mode. */
+} MVHDOpenOptions;
 
 
 extern int mvhd_errno;
@@ -188,6 +262,31 @@ MVHDAPI MVHDType mvhd_get_type(MVHDMeta* vhdm);
  */
 MVHDAPI MVHDMeta* mvhd_open(const char* path, int readonly, int* err);
 
+/**
+ * \brief Open a VHD image using the provided options
+ * 
+ * Use mvhd_open_ex if you want more control over how the VHD is accessed. For 
+ * quick opening, you can use mvhd_open.
+ * 
+ * \param [in] path Absolute path to VHD file
+ * \param [in] options the VHD open options
+ * \param [out] err will be set if the VHD fails to open. See mvhd_open for values
+ * 
+ * \return MVHDMeta pointer. If NULL, check err
+ */
+MVHDAPI MVHDMeta* mvhd_open_ex(const char* path, MVHDOpenOptions options, int* err);
+
+/**
+ * \brief Get the default storage backend
+ * 
+ * This is the backend used when no io_ops are given in the open or creation options.
+ * It accesses regular files using positional I/O. A custom backend can forward to 
+ * these functions, for example to count or time requests.
+ * 
+ * \return pointer to the default MVHDIOOps
+ */
+MVHDAPI const MVHDIOOps* mvhd_default_io_ops(void);
+
 /**
  * \brief Update the parent modified timestamp in the VHD file
  * 
@@ -206,6 +305,54 @@ MVHDAPI MVHDMeta* mvhd_open(const char* path, int readonly, int* err);
  */
 MVHDAPI int mvhd_diff_update_par_timestamp(MVHDMeta* vhdm, int* err);
 
+/**
+ * \brief Commit the contents of a differencing VHD to its parent
+ * 
+ * Only the sectors present in the differencing image are written to the parent, 
+ * a run of them at a time. Blocks are handed out to num_threads threads (including
+ * the calling one), as each block can be committed independently. The storage 
+ * backend is used from all of them at once, as in thread-safe mode.
+ * 
+ * The parent is opened for writing while this runs, and must not be in use 
+ * otherwise, nor may vhdm be used from other threads. vhdm reads the same 
+ * afterwards, and if it is writable, its parent timestamp is updated to match 
+ * the new parent. Its own handle of the parent is opened again, so duplicates 
+ * of vhdm made with mvhd_dup() must be made again as well.
+ * 
+ * If vhdm uses custom I/O callbacks, there is no timestamp to update, so 0 is
+ * returned with err set to MVHD_ERR_TIMESTAMP. 
+ * 
+ * \param [in] vhdm Differencing VHD to commit
+ * \param [in] num_threads number of threads to commit blocks with
+ * \param [out] err will be set if the contents could not be committed, or to
+ * MVHD_ERR_TIMESTAMP as described above
+ * 
+ * \return non-zero on error, 0 on success
+ */
+MVHDAPI int mvhd_diff_commit(MVHDMeta* vhdm, int num_threads, int* err);
+
+/**
+ * \brief Move a differencing VHD onto another parent
+ * 
+ * The old and new parent are compared block by block, first by their BATs and then
+ * by their data. Where they differ, the data of the old parent is copied to vhdm, 
+ * unless vhdm holds those sectors itself. vhdm therefore reads the same afterwards. 
+ * Finally, the parent UUID, timestamp and locators are pointed at the new parent.
+ * If an error occurs, vhdm is left on the old parent. The one exception is 
+ * MVHD_ERR_MEM when the owner map could not be made again: vhdm is then rebased,
+ * and reads through the chain as if it was opened without an owner map.
+ * 
+ * vhdm must be writable, and must not be used otherwise while this runs. The new 
+ * parent must have the same size as the old one.
+ * 
+ * \param [in] vhdm Differencing VHD to rebase
+ * \param [in] par_path is the path to the new parent image
+ * \param [out] err will be set if vhdm could not be rebased
+ * 
+ * \return non-zero on error, 0 on success
+ */
+MVHDAPI int mvhd_diff_rebase(MVHDMeta* vhdm, const char* par_path, int* err);
+
 /**
  * \brief Create a fixed VHD image
  * 
@@ -252,6 +399,25 @@ MVHDAPI MVHDMeta* mvhd_create_diff(const char* path, const char* par_path, int*
  */
 MVHDAPI MVHDMeta* mvhd_create_ex(MVHDCreationOptions options, int* err);
 
+/**
+ * \brief Create another handle to an open, read-only VHD
+ * 
+ * The new handle shares the BAT, headers and buffers of vhdm, so it takes 
+ * almost no time or memory to create, but it has its own file handle, sector 
+ * bitmap cache and parent handles. Give each worker thread a duplicate, and 
+ * they can all read without getting in each other's way.
+ * 
+ * A duplicate is closed with mvhd_close(), which must be done before vhdm 
+ * itself is closed.
+ * 
+ * \param [in] vhdm MiniVHD data structure, opened read-only
+ * \param [out] err MVHD_ERR_INVALID_PARAMS if vhdm is not read-only, MVHD_ERR_MEM 
+ * or MVHD_ERR_FILE
+ * 
+ * \return The new MiniVHD data structure, or NULL if an error occurred
+ */
+MVHDAPI MVHDMeta* mvhd_dup(MVHDMeta* vhdm, int* err);
+
 /**
  * \brief Safely close a VHD image
  * 
@@ -259,6 +425,20 @@ MVHDAPI MVHDMeta* mvhd_create_ex(MVHDCreationOptions options, int* err);
  */
 MVHDAPI void mvhd_close(MVHDMeta* vhdm);
 
+/**
+ * \brief Write all pending changes to the VHD file
+ * 
+ * When the VHD was opened in write-back mode, modified sector bitmaps and BAT 
+ * entries are held in memory. This writes them out, and flushes the file.
+ * For a memory mapped fixed VHD, the mapping is synced to the file first.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \return non-zero on error, 0 on success. On error, mvhd_errno will be set to 
+ * the appropriate system errno value
+ */
+MVHDAPI int mvhd_flush(MVHDMeta* vhdm);
+
 /**
  * \brief Calculate hard disk geometry from a provided size
  * 
@@ -352,6 +532,67 @@ MVHDAPI MVHDMeta* mvhd_convert_to_vhd_sparse(const char* utf8_raw_path, const ch
  */
 MVHDAPI FILE* mvhd_convert_to_raw(const char* utf8_vhd_path, const char* utf8_raw_path, int *err);
 
+/**
+ * \brief Convert a VHD image, and any parents it has, to a single sparse VHD image
+ * 
+ * The data of a differencing chain is copied straight into the new image. Only 
+ * blocks that are allocated in one of the images of the chain are read, and only
+ * those that are not all zeros are written. 
+ * 
+ * \param [in] utf8_vhd_path is the path of the VHD to convert
+ * \param [in] utf8_out_path is the path of the sparse VHD to create
+ * \param [out] err indicates what error occurred, if any
+ * 
+ * \return NULL if an error occurrs. Check value of *err for actual error. Otherwise returns pointer to a MVHDMeta struct
+ */
+MVHDAPI MVHDMeta* mvhd_flatten(const char* utf8_vhd_path, const char* utf8_out_path, int* err);
+
+/**
+ * \brief Write a compacted copy of a sparse or differencing VHD image
+ * 
+ * Blocks that hold no data are left out, and the remaining blocks are stored in
+ * the order of the disk. In a sparse image, blocks which only contain zeros are 
+ * left out as well. The copy keeps the UUID of the original, so differencing images
+ * based on it remain valid once it replaces the original. The original image 
+ * must not be in use. As the file changes, differencing images will report
+ * MVHD_ERR_TIMESTAMP until mvhd_diff_update_par_timestamp() is used on them.
+ * 
+ * \param [in] utf8_vhd_path is the path of the VHD to compact
+ * \param [in] utf8_out_path is the path of the compacted VHD to create. Must be a different file
+ * \param [out] err indicates what error occurred, if any
+ * 
+ * \return NULL if an error occurrs. Check value of *err for actual error. Otherwise returns pointer to a MVHDMeta struct of the compacted image
+ */
+MVHDAPI MVHDMeta* mvhd_compact(const char* utf8_vhd_path, const char* utf8_out_path, int* err);
+
+/**
+ * \brief Set the size of the sector bitmap cache
+ * 
+ * Sparse and differencing images keep the sector bitmaps of the most recently 
+ * used blocks in memory, so that workloads alternating between a few blocks do 
+ * not have to re-read them from file. For differencing images, the caches of 
+ * all parent images are resized as well.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] num_blocks the number of block bitmaps to cache per image. Must be at least 1
+ * \param [out] err will be set if the cache could not be resized
+ * 
+ * \return non-zero on error, 0 on success
+ */
+MVHDAPI int mvhd_set_bitmap_cache_size(MVHDMeta* vhdm, int num_blocks, int* err);
+
+/**
+ * \brief Get the sector bitmap cache statistics
+ * 
+ * The counts are summed over the image and all of its parents, and are reset 
+ * whenever the cache is resized.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [out] hits the number of bitmap lookups served from memory
+ * \param [out] misses the number of bitmap lookups that had to (re)load a bitmap
+ */
+MVHDAPI void mvhd_get_bitmap_cache_stats(MVHDMeta* vhdm, uint64_t* hits, uint64_t* misses);
+
 /**
  * \brief Read sectors from VHD file
  * 
@@ -380,6 +621,79 @@ MVHDAPI int mvhd_read_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors,
  */
 MVHDAPI int mvhd_write_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
 
+/**
+ * \brief Read sectors from VHD file into a scatter/gather list
+ * 
+ * Same as mvhd_read_sectors(), but the data is stored into the buffers of iov, 
+ * filling each one in turn. Buffer lengths need not be a multiple of the sector 
+ * size. On fixed and dynamic images, the data is read straight into the buffers.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start reading from
+ * \param [in] num_sectors the number of sectors to read
+ * \param [in] iov the buffers to store sector data in
+ * \param [in] iovcnt the number of buffers in iov
+ * 
+ * \return the number of sectors that were not read, or zero. If the buffers 
+ * hold less than num_sectors, only the whole sectors that fit are read.
+ */
+MVHDAPI int mvhd_readv_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt);
+
+/**
+ * \brief Write sectors to VHD file from a scatter/gather list
+ * 
+ * Same as mvhd_write_sectors(), but the data is taken from the buffers of iov, 
+ * each one in turn. See mvhd_readv_sectors().
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start writing to
+ * \param [in] num_sectors the number of sectors to write
+ * \param [in] iov the buffers holding the sector data
+ * \param [in] iovcnt the number of buffers in iov
+ * 
+ * \return the number of sectors that were not written, or zero
+ */
+MVHDAPI int mvhd_writev_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOVec* iov, int iovcnt);
+
+/**
+ * \brief Submit a batch of sector reads and writes
+ * 
+ * The requests are translated to file offsets, sorted, and adjacent ones are 
+ * merged, so that a fragmented dynamic VHD is accessed in file order rather 
+ * than in sector order. The outcome is the same as calling mvhd_read_sectors()
+ * and mvhd_write_sectors() for each request in turn: requests that depend on an
+ * earlier one in the batch (overlapping, with at least one of them a write) are
+ * not moved ahead of it. All requests are done when this function returns.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] reqs the requests. The result field of each is set to the number 
+ * of sectors that were not transferred, as mvhd_read_sectors() would return
+ * \param [in] count the number of requests
+ * 
+ * \return the number of requests that were not done in full, or zero
+ */
+MVHDAPI int mvhd_submit_batch(MVHDMeta* vhdm, MVHDBatchReq* reqs, int count);
+
+/**
+ * \brief Discard sectors that are no longer in use (TRIM/UNMAP)
+ * 
+ * The sectors of a dynamic VHD read as zeroes afterwards, and those of a 
+ * differencing VHD read from its parent again. When a block has no sectors 
+ * left in use, its space in the file is reused for the next block that is 
+ * needed, so the VHD stops growing while the guest keeps discarding. The 
+ * BAT entry of such a block is written at once, even in write-back mode. 
+ * 
+ * Nothing is done for fixed or read-only VHDs. A read of sectors that are 
+ * being discarded at the same time, from another thread, may return anything.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start discarding
+ * \param [in] num_sectors the number of sectors to discard
+ * 
+ * \return the number of sectors that were not discarded, or zero
+ */
+MVHDAPI int mvhd_discard_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
 /**
  * \brief Write zeroed sectors to VHD file
  * 
@@ -395,6 +709,82 @@ MVHDAPI int mvhd_write_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors,
  */
 MVHDAPI int mvhd_format_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
 
+/**
+ * \brief Read sectors from VHD file, without waiting for the read to complete
+ * 
+ * The request is performed by a pool of worker threads. Requests that overlap 
+ * an earlier write (or writes that overlap an earlier request) on the same VHD
+ * are performed, and called back, in the order they were submitted.
+ * 
+ * When the request completes, callback is called with the return value of 
+ * mvhd_read_sectors() as result. This happens on a worker thread, unless 
+ * mvhd_async_event_fd() was called for the VHD.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start reading from
+ * \param [in] num_sectors the number of sectors to read
+ * \param [out] out_buff the buffer to write sector data to. Must stay valid until the callback
+ * \param [in] callback function to call on completion, or NULL
+ * \param [in] user_data passed to the callback
+ * \param [out] err MVHD_ERR_INVALID_PARAMS or MVHD_ERR_MEM if the request could not be submitted
+ * 
+ * \return 0 if the request was submitted, -1 otherwise
+ */
+MVHDAPI int mvhd_read_sectors_async(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff, mvhd_async_callback callback, void* user_data, int* err);
+
+/**
+ * \brief Write sectors to VHD file, without waiting for the write to complete
+ * 
+ * See mvhd_read_sectors_async(). The result is the return value of mvhd_write_sectors().
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start writing to
+ * \param [in] num_sectors the number of sectors to write
+ * \param [in] in_buff the buffer to read sector data from. Must stay valid until the callback
+ * \param [in] callback function to call on completion, or NULL
+ * \param [in] user_data passed to the callback
+ * \param [out] err MVHD_ERR_INVALID_PARAMS or MVHD_ERR_MEM if the request could not be submitted
+ * 
+ * \return 0 if the request was submitted, -1 otherwise
+ */
+MVHDAPI int mvhd_write_sectors_async(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff, mvhd_async_callback callback, void* user_data, int* err);
+
+/**
+ * \brief Get a file descriptor that becomes readable when asynchronous requests complete
+ * 
+ * This is for use with an event loop (poll, epoll, select). Once this is called,
+ * completion callbacks for the VHD are no longer run on the worker threads, but 
+ * by mvhd_async_reap(), which should be called when the descriptor is readable.
+ * 
+ * The descriptor is an eventfd, so this is only available on Linux.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \return the file descriptor, or -1 if not available
+ */
+MVHDAPI int mvhd_async_event_fd(MVHDMeta* vhdm);
+
+/**
+ * \brief Run the callbacks of all completed asynchronous requests
+ * 
+ * Only needed after mvhd_async_event_fd() was called. The callbacks are run 
+ * on the calling thread, in completion order.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \return the number of requests called back
+ */
+MVHDAPI int mvhd_async_reap(MVHDMeta* vhdm);
+
+/**
+ * \brief Wait until all asynchronous requests on a VHD have completed, and were called back
+ * 
+ * mvhd_close() does this too. Must not be called from a completion callback.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+MVHDAPI void mvhd_async_wait(MVHDMeta* vhdm);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,238 @@
+/*
+ * MiniVHD	Minimalist VHD implementation in C.
+ *
+ *		This file is part of the MiniVHD Project.
+ *
+ *		Management of the unused space in dynamic and differencing images.
+ *
+ * Version:	@(#)space.c	1.0.0	2026/10/16
+ *
+ * Authors:	Sherman Perry, <shermperry@gmail.com>
+ *		Fred N. van Kempen, <waltje@varcem.com>
+ *
+ *		Copyright 2019-2021 Sherman Perry.
+ *		Copyright 2021 Fred N. van Kempen.
+ *
+ *		MIT License
+ *
+ *		Permission is hereby granted, free of  charge, to any person
+ *		obtaining a copy of this software  and associated documenta-
+ *		tion files (the "Software"), to deal in the Software without
+ *		restriction, including without limitation the rights to use,
+ *		copy, modify, merge, publish, distribute, sublicense, and/or
+ *		sell copies of  the Software, and  to permit persons to whom
+ *		the Software is furnished to do so, subject to the following
+ *		conditions:
+ *
+ *		The above  copyright notice and this permission notice shall
+ *		be included in  all copies or  substantial  portions of  the
+ *		Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING  BUT NOT LIMITED TO THE  WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN  NO EVENT  SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER  IN AN ACTION OF  CONTRACT, TORT OR  OTHERWISE, ARISING
+ * FROM, OUT OF  O R IN  CONNECTION WITH THE  SOFTWARE OR  THE USE  OR  OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#define BUILDING_LIBRARY
+#include "minivhd.h"
+#include "internal.h"
+
+
+/*
+ * Parts of the file that are not used by the image's metadata or blocks 
+ * are kept in a list of extents, sorted by offset, with neighbouring ones 
+ * merged. Blocks are allocated from that first, so space that was given 
+ * back is reused before the file grows. Nothing is assumed about what the 
+ * unused space holds, be it a discarded block or a gap left by another tool.
+ */
+
+
+static int
+extent_cmp(const void* a, const void* b)
+{
+    const MVHDExtent* ea = (const MVHDExtent*)a;
+    const MVHDExtent* eb = (const MVHDExtent*)b;
+
+    if (ea->sect != eb->sect) {
+        return (ea->sect < eb->sect) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+uint64_t
+mvhd_par_loc_bytes(const MVHDSparseHeader* sparse, int i)
+{
+    uint32_t space = sparse->par_loc_entry[i].plat_data_space;
+
+    if (space % MVHD_SECTOR_SIZE == 0 && space >= sparse->par_loc_entry[i].plat_data_len) {
+        return space;
+    }
+
+    return (uint64_t)space * MVHD_SECTOR_SIZE;
+}
+
+
+void
+mvhd_free_space_init(MVHDMeta* vhdm)
+{
+    MVHDExtent* used;
+    uint32_t slot, pos, end, file_end;
+    uint32_t i;
+    int j, n;
+
+    /* Only gaps that can hold an entire block are worth keeping */
+    slot = (uint32_t)(vhdm->bitmap.sector_count + vhdm->sect_per_block);
+    file_end = (uint32_t)(vhdm->footer_pos / MVHD_SECTOR_SIZE);
+
+    /* The footer copy, sparse header, BAT and parent locators, and then the blocks */
+    used = malloc(((size_t)vhdm->sparse.max_bat_ent + 11) * sizeof *used);
+    if (used == NULL) {
+        /* Not fatal, the file then just grows for every new block */
+        return;
+    }
+
+    n = 0;
+    used[n].sect = 0;
+    used[n++].count = 1;
+    used[n].sect = (uint32_t)(vhdm->footer.data_offset / MVHD_SECTOR_SIZE);
+    used[n++].count = MVHD_SPARSE_SIZE / MVHD_SECTOR_SIZE;
+    used[n].sect = (uint32_t)(vhdm->sparse.bat_offset / MVHD_SECTOR_SIZE);
+    used[n++].count = (vhdm->sparse.max_bat_ent + MVHD_BAT_ENT_PER_SECT - 1) / MVHD_BAT_ENT_PER_SECT;
+    for (j = 0; j < 8; j++) {
+        if (vhdm->sparse.par_loc_entry[j].plat_code == 0) {
+            continue;
+        }
+        used[n].sect = (uint32_t)(vhdm->sparse.par_loc_entry[j].plat_data_offset / MVHD_SECTOR_SIZE);
+        used[n++].count = (uint32_t)((mvhd_par_loc_bytes(&vhdm->sparse, j) + MVHD_SECTOR_SIZE - 1) / MVHD_SECTOR_SIZE);
+    }
+    for (i = 0; i < vhdm->sparse.max_bat_ent; i++) {
+        if (vhdm->block_offset[i] != MVHD_SPARSE_BLK) {
+            used[n].sect = vhdm->block_offset[i];
+            used[n++].count = slot;
+        }
+    }
+    qsort(used, n, sizeof *used, extent_cmp);
+
+    pos = 0;
+    for (j = 0; j < n; j++) {
+        if (used[j].sect > pos && used[j].sect - pos >= slot) {
+            mvhd_free_space_add(vhdm, pos, used[j].sect - pos);
+        }
+        end = used[j].sect + used[j].count;
+        if (end > pos) {
+            pos = end;
+        }
+    }
+    if (file_end > pos && file_end - pos >= slot) {
+        mvhd_free_space_add(vhdm, pos, file_end - pos);
+    }
+
+    free(used);
+}
+
+
+void
+mvhd_free_space_add(MVHDMeta* vhdm, uint32_t sect, uint32_t count)
+{
+    MVHDExtent* ext = vhdm->free_space.ext;
+    int n = vhdm->free_space.num;
+    int lo, hi, mid, size;
+    bool prev, next;
+
+    if (count == 0) {
+        return;
+    }
+
+    /* Find the first extent that starts after the new one */
+    lo = 0;
+    hi = n;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (ext[mid].sect < sect) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    prev = (lo > 0 && ext[lo - 1].sect + ext[lo - 1].count == sect);
+    next = (lo < n && sect + count == ext[lo].sect);
+    if (prev && next) {
+        ext[lo - 1].count += count + ext[lo].count;
+        memmove(&ext[lo], &ext[lo + 1], (size_t)(n - lo - 1) * sizeof *ext);
+        vhdm->free_space.num--;
+        return;
+    }
+    if (prev) {
+        ext[lo - 1].count += count;
+        return;
+    }
+    if (next) {
+        ext[lo].sect = sect;
+        ext[lo].count += count;
+        return;
+    }
+
+    if (n == vhdm->free_space.size) {
+        size = (n > 0) ? n * 2 : 16;
+        ext = realloc(ext, (size_t)size * sizeof *ext);
+        if (ext == NULL) {
+            /* The space is simply not reused */
+            return;
+        }
+        vhdm->free_space.ext = ext;
+        vhdm->free_space.size = size;
+    }
+
+    memmove(&ext[lo + 1], &ext[lo], (size_t)(n - lo) * sizeof *ext);
+    ext[lo].sect = sect;
+    ext[lo].count = count;
+    vhdm->free_space.num++;
+}
+
+
+bool
+mvhd_free_space_take(MVHDMeta* vhdm, uint32_t count, uint32_t* sect)
+{
+    MVHDExtent* ext = vhdm->free_space.ext;
+    int i;
+
+    /* First fit, which keeps the data towards the start of the file */
+    for (i = 0; i < vhdm->free_space.num; i++) {
+        if (ext[i].count < count) {
+            continue;
+        }
+
+        *sect = ext[i].sect;
+        ext[i].sect += count;
+        ext[i].count -= count;
+        if (ext[i].count == 0) {
+            memmove(&ext[i], &ext[i + 1], (size_t)(vhdm->free_space.num - i - 1) * sizeof *ext);
+            vhdm->free_space.num--;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+
+void
+mvhd_free_space_free(MVHDMeta* vhdm)
+{
+    free(vhdm->free_space.ext);
+    vhdm->free_space.ext = NULL;
+    vhdm->free_space.num = 0;
+    vhdm->free_space.size = 0;
+}
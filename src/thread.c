@@ -0,0 +1,339 @@
+/*
+ * MiniVHD	Minimalist VHD implementation in C.
+ *
+ *		This file is part of the MiniVHD Project.
+ *
+ *		Portable threads, mutexes and condition variables.
+ *
+ * Version:	@(#)thread.c	1.0.0	2026/10/16
+ *
+ * Authors:	Sherman Perry, <shermperry@gmail.com>
+ *		Fred N. van Kempen, <waltje@varcem.com>
+ *
+ *		Copyright 2019-2021 Sherman Perry.
+ *		Copyright 2021 Fred N. van Kempen.
+ *
+ *		MIT License
+ *
+ *		Permission is hereby granted, free of  charge, to any person
+ *		obtaining a copy of this software  and associated documenta-
+ *		tion files (the "Software"), to deal in the Software without
+ *		restriction, including without limitation the rights to use,
+ *		copy, modify, merge, publish, distribute, sublicense, and/or
+ *		sell copies of  the Software, and  to permit persons to whom
+ *		the Software is furnished to do so, subject to the following
+ *		conditions:
+ *
+ *		The above  copyright notice and this permission notice shall
+ *		be included in  all copies or  substantial  portions of  the
+ *		Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING  BUT NOT LIMITED TO THE  WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN  NO EVENT  SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER  IN AN ACTION OF  CONTRACT, TORT OR  OTHERWISE, ARISING
+ * FROM, OUT OF  O R IN  CONNECTION WITH THE  SOFTWARE OR  THE USE  OR  OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef _WIN32
+# include <windows.h>
+# include <process.h>
+#else
+# include <pthread.h>
+# include <sched.h>
+#endif
+#define BUILDING_LIBRARY
+#include "minivhd.h"
+#include "internal.h"
+
+
+#ifdef _WIN32
+struct MVHDMutex {
+    CRITICAL_SECTION cs;
+};
+
+struct MVHDCond {
+    CONDITION_VARIABLE cv;
+};
+#else
+struct MVHDMutex {
+    pthread_mutex_t mutex;
+};
+
+struct MVHDCond {
+    pthread_cond_t cond;
+};
+#endif
+
+/* What a new thread should run */
+typedef struct ThreadStart {
+    void	(*func)(void* arg);
+    void*	arg;
+} ThreadStart;
+
+
+MVHDMutex *
+mvhd_mutex_create(void)
+{
+    MVHDMutex* m = calloc(1, sizeof *m);
+
+    if (m == NULL) {
+        return NULL;
+    }
+#ifdef _WIN32
+    InitializeCriticalSection(&m->cs);
+#else
+    if (pthread_mutex_init(&m->mutex, NULL) != 0) {
+        free(m);
+        return NULL;
+    }
+#endif
+
+    return m;
+}
+
+
+void
+mvhd_mutex_destroy(MVHDMutex* m)
+{
+    if (m == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    DeleteCriticalSection(&m->cs);
+#else
+    pthread_mutex_destroy(&m->mutex);
+#endif
+    free(m);
+}
+
+
+void
+mvhd_mutex_lock(MVHDMutex* m)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&m->cs);
+#else
+    pthread_mutex_lock(&m->mutex);
+#endif
+}
+
+
+void
+mvhd_mutex_unlock(MVHDMutex* m)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&m->cs);
+#else
+    pthread_mutex_unlock(&m->mutex);
+#endif
+}
+
+
+MVHDCond *
+mvhd_cond_create(void)
+{
+    MVHDCond* c = calloc(1, sizeof *c);
+
+    if (c == NULL) {
+        return NULL;
+    }
+#ifdef _WIN32
+    InitializeConditionVariable(&c->cv);
+#else
+    if (pthread_cond_init(&c->cond, NULL) != 0) {
+        free(c);
+        return NULL;
+    }
+#endif
+
+    return c;
+}
+
+
+void
+mvhd_cond_destroy(MVHDCond* c)
+{
+    if (c == NULL) {
+        return;
+    }
+#ifndef _WIN32
+    pthread_cond_destroy(&c->cond);
+#endif
+    free(c);
+}
+
+
+void
+mvhd_cond_wait(MVHDCond* c, MVHDMutex* m)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(&c->cv, &m->cs, INFINITE);
+#else
+    pthread_cond_wait(&c->cond, &m->mutex);
+#endif
+}
+
+
+void
+mvhd_cond_signal(MVHDCond* c)
+{
+#ifdef _WIN32
+    WakeConditionVariable(&c->cv);
+#else
+    pthread_cond_signal(&c->cond);
+#endif
+}
+
+
+void
+mvhd_cond_broadcast(MVHDCond* c)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(&c->cv);
+#else
+    pthread_cond_broadcast(&c->cond);
+#endif
+}
+
+
+uint32_t
+mvhd_atomic_load32(const volatile uint32_t* p)
+{
+#ifdef _MSC_VER
+    return (uint32_t)InterlockedCompareExchange((volatile LONG*)p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
+void
+mvhd_atomic_store32(volatile uint32_t* p, uint32_t val)
+{
+#ifdef _MSC_VER
+    InterlockedExchange((volatile LONG*)p, (LONG)val);
+#else
+    __atomic_store_n(p, val, __ATOMIC_RELEASE);
+#endif
+}
+
+
+int64_t
+mvhd_atomic_load64(const volatile int64_t* p)
+{
+#ifdef _MSC_VER
+    return InterlockedCompareExchange64((volatile LONG64*)p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
+bool
+mvhd_atomic_cas64(volatile int64_t* p, int64_t* expected, int64_t desired)
+{
+#ifdef _MSC_VER
+    int64_t prev = InterlockedCompareExchange64((volatile LONG64*)p, desired, *expected);
+
+    if (prev == *expected) {
+        return true;
+    }
+    *expected = prev;
+
+    return false;
+#else
+    return __atomic_compare_exchange_n(p, expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
+void
+mvhd_once(MVHDOnce* once, void (*func)(void))
+{
+#ifdef _MSC_VER
+    if (InterlockedCompareExchange(once, 1, 0) == 0) {
+        func();
+        InterlockedExchange(once, 2);
+        return;
+    }
+    while (InterlockedCompareExchange(once, 2, 2) != 2) {
+        Sleep(0);
+    }
+#else
+    long expected = 0;
+
+    if (__atomic_compare_exchange_n(once, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        func();
+        __atomic_store_n(once, 2, __ATOMIC_RELEASE);
+        return;
+    }
+    /* Someone else is running it, wait for them to finish */
+    while (__atomic_load_n(once, __ATOMIC_ACQUIRE) != 2) {
+# ifdef _WIN32
+        Sleep(0);
+# else
+        sched_yield();
+# endif
+    }
+#endif
+}
+
+
+#ifdef _WIN32
+static unsigned __stdcall
+thread_main(void* arg)
+#else
+static void *
+thread_main(void* arg)
+#endif
+{
+    ThreadStart start = *(ThreadStart*)arg;
+
+    free(arg);
+    start.func(start.arg);
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+
+int
+mvhd_thread_start(void (*func)(void* arg), void* arg)
+{
+    ThreadStart* start;
+
+    start = malloc(sizeof *start);
+    if (start == NULL) {
+        return -1;
+    }
+    start->func = func;
+    start->arg = arg;
+
+#ifdef _WIN32
+    uintptr_t h = _beginthreadex(NULL, 0, thread_main, start, 0, NULL);
+    if (h == 0) {
+        free(start);
+        return -1;
+    }
+    CloseHandle((HANDLE)h);
+#else
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, thread_main, start) != 0) {
+        free(start);
+        return -1;
+    }
+    pthread_detach(tid);
+#endif
+
+    return 0;
+}
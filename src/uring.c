@@ -0,0 +1,391 @@
+/*
+ * MiniVHD	Minimalist VHD implementation in C.
+ *
+ *		This file is part of the MiniVHD Project.
+ *
+ *		Linux io_uring support, used to submit batches of file I/O.
+ *
+ * Version:	@(#)uring.c	1.0.0	2026/10/16
+ *
+ * Authors:	Sherman Perry, <shermperry@gmail.com>
+ *		Fred N. van Kempen, <waltje@varcem.com>
+ *
+ *		Copyright 2019-2021 Sherman Perry.
+ *		Copyright 2021 Fred N. van Kempen.
+ *
+ *		MIT License
+ *
+ *		Permission is hereby granted, free of  charge, to any person
+ *		obtaining a copy of this software  and associated documenta-
+ *		tion files (the "Software"), to deal in the Software without
+ *		restriction, including without limitation the rights to use,
+ *		copy, modify, merge, publish, distribute, sublicense, and/or
+ *		sell copies of  the Software, and  to permit persons to whom
+ *		the Software is furnished to do so, subject to the following
+ *		conditions:
+ *
+ *		The above  copyright notice and this permission notice shall
+ *		be included in  all copies or  substantial  portions of  the
+ *		Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING  BUT NOT LIMITED TO THE  WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN  NO EVENT  SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER  IN AN ACTION OF  CONTRACT, TORT OR  OTHERWISE, ARISING
+ * FROM, OUT OF  O R IN  CONNECTION WITH THE  SOFTWARE OR  THE USE  OR  OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _FILE_OFFSET_BITS
+# define _FILE_OFFSET_BITS 64
+#endif
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#define BUILDING_LIBRARY
+#include "minivhd.h"
+#include "internal.h"
+
+#ifdef USE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+/* One queued request, indexed by the submission slot it uses. */
+typedef struct RingReq {
+    struct iovec iov;
+    uint64_t	offset;
+    bool	write;
+    bool	done;		/* completed by the ring */
+} RingReq;
+
+struct MVHDRing {
+    int		ring_fd;
+    int		fd;		/* the file all requests are for */
+    unsigned	depth;
+    unsigned	queued;		/* requests waiting for mvhd_ring_submit() */
+    bool	broken;		/* io_uring_enter() failed, do it all synchronously */
+    RingReq*	reqs;
+
+    /* Submission queue, shared with the kernel */
+    unsigned*	sq_tail;
+    unsigned*	sq_mask;
+    unsigned*	sq_array;
+    struct io_uring_sqe* sqes;
+
+    /* Completion queue, shared with the kernel */
+    unsigned*	cq_head;
+    unsigned*	cq_tail;
+    unsigned*	cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void*	sq_ptr;
+    size_t	sq_len;
+    void*	cq_ptr;
+    size_t	cq_len;
+    size_t	sqes_len;
+};
+
+
+static int
+ring_enter(int ring_fd, unsigned to_submit, unsigned min_complete)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+
+/**
+ * \brief Finish a request that the ring transferred only partially (or not at all)
+ * 
+ * \param [in] ring The ring the request was queued on
+ * \param [in] req The request
+ * \param [in] done The number of bytes already transferred
+ * 
+ * \return 0 if the rest of the request succeeded, -1 otherwise
+ */
+static int
+finish_sync(MVHDRing* ring, RingReq* req, size_t done)
+{
+    uint8_t* buff = (uint8_t*)req->iov.iov_base;
+    ssize_t n;
+
+    while (done < req->iov.iov_len) {
+        if (req->write) {
+            n = pwrite(ring->fd, buff + done, req->iov.iov_len - done, (off_t)(req->offset + done));
+        } else {
+            n = pread(ring->fd, buff + done, req->iov.iov_len - done, (off_t)(req->offset + done));
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                mvhd_errno = errno;
+            }
+            if (!req->write) {
+                /* Same as mvhd_read_at(), anything we could not read is zero */
+                memset(buff + done, 0, req->iov.iov_len - done);
+            }
+            return -1;
+        }
+        done += (size_t)n;
+    }
+
+    return 0;
+}
+
+
+MVHDRing *
+mvhd_ring_create(int fd, unsigned depth)
+{
+    struct io_uring_params p;
+    MVHDRing* ring;
+
+    ring = calloc(1, sizeof *ring);
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof p);
+    ring->ring_fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (ring->ring_fd < 0) {
+        /* No io_uring in this kernel, or we are not allowed to use it */
+        free(ring);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->depth = p.sq_entries;
+
+    ring->sq_len = p.sq_off.array + (p.sq_entries * sizeof(unsigned));
+    ring->cq_len = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        goto cleanup_fd;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            goto cleanup_sq;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto cleanup_cq;
+    }
+
+    ring->sq_tail = (unsigned*)((uint8_t*)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)((uint8_t*)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((uint8_t*)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned*)((uint8_t*)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned*)((uint8_t*)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)((uint8_t*)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((uint8_t*)ring->cq_ptr + p.cq_off.cqes);
+
+    ring->reqs = calloc(ring->depth, sizeof *ring->reqs);
+    if (ring->reqs == NULL) {
+        goto cleanup_sqes;
+    }
+
+    return ring;
+
+cleanup_sqes:
+    munmap(ring->sqes, ring->sqes_len);
+
+cleanup_cq:
+    if (ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+
+cleanup_sq:
+    munmap(ring->sq_ptr, ring->sq_len);
+
+cleanup_fd:
+    close(ring->ring_fd);
+    free(ring);
+
+    return NULL;
+}
+
+
+void
+mvhd_ring_destroy(MVHDRing* ring)
+{
+    if (ring == NULL) {
+        return;
+    }
+
+    mvhd_ring_submit(ring);
+
+    free(ring->reqs);
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->ring_fd);
+    free(ring);
+}
+
+
+int
+mvhd_ring_queue(MVHDRing* ring, void* buffer, size_t size, uint64_t offset, bool write)
+{
+    RingReq* req;
+    int ret = 0;
+
+    if (ring->queued == ring->depth) {
+        ret = mvhd_ring_submit(ring);
+    }
+
+    req = &ring->reqs[ring->queued++];
+    req->iov.iov_base = buffer;
+    req->iov.iov_len = size;
+    req->offset = offset;
+    req->write = write;
+
+    if (ring->broken) {
+        ring->queued = 0;
+        return finish_sync(ring, req, 0) | ret;
+    }
+
+    return ret;
+}
+
+
+/**
+ * \brief Handle the completions the kernel has posted so far
+ * 
+ * Requests the ring transferred only partially are finished synchronously.
+ * 
+ * \param [in] ring The ring to take completions from
+ * \param [in,out] completed The number of requests completed, updated
+ * 
+ * \return 0 if all those requests succeeded, -1 otherwise
+ */
+static int
+reap_completions(MVHDRing* ring, unsigned* completed)
+{
+    struct io_uring_cqe* cqe;
+    RingReq* req;
+    unsigned head;
+    int ret = 0;
+
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        req = &ring->reqs[cqe->user_data];
+        req->done = true;
+        if (cqe->res < 0 || (size_t)cqe->res < req->iov.iov_len) {
+            if (finish_sync(ring, req, (cqe->res < 0) ? 0 : (size_t)cqe->res) < 0) {
+                ret = -1;
+            }
+        }
+        head++;
+        (*completed)++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return ret;
+}
+
+
+int
+mvhd_ring_submit(MVHDRing* ring)
+{
+    struct io_uring_sqe* sqe;
+    RingReq* req;
+    unsigned i, tail, submitted, completed;
+    int n, ret = 0;
+
+    if (ring->queued == 0) {
+        return 0;
+    }
+
+    /* We are the only producer, so only the kernel's view of the tail needs ordering */
+    tail = *ring->sq_tail;
+    for (i = 0; i < ring->queued; i++) {
+        req = &ring->reqs[i];
+        req->done = false;
+        sqe = &ring->sqes[tail & *ring->sq_mask];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = ring->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+        sqe->len = 1;
+        sqe->off = req->offset;
+        sqe->user_data = i;
+        ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* Submit everything, and wait for all of it to complete */
+    submitted = 0;
+    completed = 0;
+    while (completed < ring->queued) {
+        n = ring_enter(ring->ring_fd, ring->queued - submitted, ring->queued - completed);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+
+            /* Take back what the kernel did not take from the queue, and give up on the ring */
+            __atomic_store_n(ring->sq_tail, tail - (ring->queued - submitted), __ATOMIC_RELEASE);
+            ring->broken = true;
+            break;
+        }
+        submitted += (unsigned)n;
+
+        if (reap_completions(ring, &completed) < 0) {
+            ret = -1;
+        }
+    }
+
+    if (ring->broken) {
+        /**
+         * The kernel may still be transferring into the buffers of what it did
+         * take, so wait for those before doing anything else with them.
+         */
+        while (completed < submitted) {
+            n = ring_enter(ring->ring_fd, 0, submitted - completed);
+            if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                break;
+            }
+            if (reap_completions(ring, &completed) < 0) {
+                ret = -1;
+            }
+        }
+
+        /* The kernel takes requests in order, so the rest was never started */
+        for (i = 0; i < ring->queued; i++) {
+            if (ring->reqs[i].done) {
+                continue;
+            }
+            if (i < submitted || finish_sync(ring, &ring->reqs[i], 0) < 0) {
+                /* Still in flight, so this one can only fail */
+                ret = -1;
+            }
+        }
+    }
+    ring->queued = 0;
+
+    return ret;
+}
+#endif
@@ -46,6 +46,14 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+# define HAVE_X86_SIMD
+# include <emmintrin.h>
+# include <immintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+# endif
+#endif
 #define BUILDING_LIBRARY
 #include "minivhd.h"
 #include "internal.h"
@@ -465,6 +473,174 @@ mvhd_crc32(const void* data, size_t n_bytes)
 }
 
 
+/**
+ * \brief Check a buffer for zeroes a machine word at a time
+ * 
+ * This is the fallback for CPUs without SIMD support, and handles whatever
+ * is left over by the vector versions.
+ */
+static bool
+is_zero_scalar(const uint8_t* p, size_t n_bytes)
+{
+    uint64_t acc;
+
+    /* Get to a word boundary first */
+    while (n_bytes > 0 && ((uintptr_t)p & 7) != 0) {
+        if (*p++ != 0) {
+            return false;
+        }
+        n_bytes--;
+    }
+
+    /* Check 64 bytes at a time, and only test the result once for all of them */
+    while (n_bytes >= 64) {
+        const uint64_t* w = (const uint64_t*)p;
+
+        acc = w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7];
+        if (acc != 0) {
+            return false;
+        }
+        p += 64;
+        n_bytes -= 64;
+    }
+    while (n_bytes >= 8) {
+        if (*(const uint64_t*)p != 0) {
+            return false;
+        }
+        p += 8;
+        n_bytes -= 8;
+    }
+    while (n_bytes > 0) {
+        if (*p++ != 0) {
+            return false;
+        }
+        n_bytes--;
+    }
+
+    return true;
+}
+
+
+#ifdef HAVE_X86_SIMD
+# if defined(__GNUC__)
+#  define TARGET_SSE2	__attribute__((target("sse2")))
+#  define TARGET_AVX2	__attribute__((target("avx2")))
+# else
+#  define TARGET_SSE2	/*nothing*/
+#  define TARGET_AVX2	/*nothing*/
+# endif
+
+
+/**
+ * \brief Check a buffer for zeroes 64 bytes at a time, using SSE2
+ */
+TARGET_SSE2 static bool
+is_zero_sse2(const uint8_t* p, size_t n_bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc;
+
+    while (n_bytes >= 64) {
+        acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)p),
+                                        _mm_loadu_si128((const __m128i*)(p + 16))),
+                           _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + 32)),
+                                        _mm_loadu_si128((const __m128i*)(p + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+            return false;
+        }
+        p += 64;
+        n_bytes -= 64;
+    }
+
+    return is_zero_scalar(p, n_bytes);
+}
+
+
+/**
+ * \brief Check a buffer for zeroes 128 bytes at a time, using AVX2
+ */
+TARGET_AVX2 static bool
+is_zero_avx2(const uint8_t* p, size_t n_bytes)
+{
+    __m256i acc;
+
+    while (n_bytes >= 128) {
+        acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)p),
+                                              _mm256_loadu_si256((const __m256i*)(p + 32))),
+                              _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + 64)),
+                                              _mm256_loadu_si256((const __m256i*)(p + 96))));
+        if (!_mm256_testz_si256(acc, acc)) {
+            return false;
+        }
+        p += 128;
+        n_bytes -= 128;
+    }
+
+    return is_zero_sse2(p, n_bytes);
+}
+#endif
+
+
+static bool (*is_zero_func)(const uint8_t*, size_t) = is_zero_scalar;
+static MVHDOnce is_zero_once;
+static volatile uint32_t is_zero_ready;
+
+
+/**
+ * \brief Pick the fastest zero check the CPU we run on supports
+ */
+static void
+is_zero_init(void)
+{
+#ifdef HAVE_X86_SIMD
+# ifdef _MSC_VER
+    int regs[4];
+    int max_leaf;
+    bool avx = false;
+
+    __cpuid(regs, 0);
+    max_leaf = regs[0];
+    __cpuid(regs, 1);
+    if (regs[3] & (1 << 26)) {
+        is_zero_func = is_zero_sse2;
+    }
+
+    /* AVX needs the OS to save the YMM registers as well */
+    if ((regs[2] & (1 << 27)) && (regs[2] & (1 << 28))) {
+        avx = (_xgetbv(0) & 6) == 6;
+    }
+    if (avx && max_leaf >= 7) {
+        __cpuidex(regs, 7, 0);
+        if (regs[1] & (1 << 5)) {
+            is_zero_func = is_zero_avx2;
+        }
+    }
+# else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        is_zero_func = is_zero_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        is_zero_func = is_zero_avx2;
+    }
+# endif
+#endif
+    mvhd_atomic_store32(&is_zero_ready, 1);
+}
+
+
+bool
+mvhd_is_zero(const void* data, size_t n_bytes)
+{
+    /* Cheaper than going through mvhd_once() on every call */
+    if (mvhd_atomic_load32(&is_zero_ready) == 0) {
+        mvhd_once(&is_zero_once, is_zero_init);
+    }
+
+    return is_zero_func((const uint8_t*)data, n_bytes);
+}
+
+
 uint32_t
 mvhd_file_mod_timestamp(const char* path, int *err)
 {
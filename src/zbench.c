@@ -0,0 +1,186 @@
+/*
+ * MiniVHD	Minimalist VHD implementation in C.
+ *
+ *		This file is part of the MiniVHD Project.
+ *
+ *		Benchmark for the check for all-zero data.
+ *
+ * Version:	@(#)zbench.c	1.0.0	2026/10/16
+ *
+ * Authors:	Sherman Perry, <shermperry@gmail.com>
+ *		Fred N. van Kempen, <waltje@varcem.com>
+ *
+ *		Copyright 2019-2021 Sherman Perry.
+ *		Copyright 2021 Fred N. van Kempen.
+ *
+ *		MIT License
+ *
+ *		Permission is hereby granted, free of  charge, to any person
+ *		obtaining a copy of this software  and associated documenta-
+ *		tion files (the "Software"), to deal in the Software without
+ *		restriction, including without limitation the rights to use,
+ *		copy, modify, merge, publish, distribute, sublicense, and/or
+ *		sell copies of  the Software, and  to permit persons to whom
+ *		the Software is furnished to do so, subject to the following
+ *		conditions:
+ *
+ *		The above  copyright notice and this permission notice shall
+ *		be included in  all copies or  substantial  portions of  the
+ *		Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING  BUT NOT LIMITED TO THE  WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN  NO EVENT  SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER  IN AN ACTION OF  CONTRACT, TORT OR  OTHERWISE, ARISING
+ * FROM, OUT OF  O R IN  CONNECTION WITH THE  SOFTWARE OR  THE USE  OR  OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#define BUILDING_LIBRARY
+#include "minivhd.h"
+#include "internal.h"
+
+
+#define CHUNK_SIZE	4096		/* what the converter used to compare */
+
+
+typedef bool (*ZeroFunc)(const void* data, size_t n_bytes);
+
+
+static const uint8_t zero_chunk[CHUNK_SIZE];
+
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+/* Compare against a buffer of zeroes, a chunk at a time. */
+static bool
+zero_memcmp_chunks(const void* data, size_t n_bytes)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    size_t n;
+
+    for (; n_bytes > 0; n_bytes -= n, p += n) {
+        n = (n_bytes < CHUNK_SIZE) ? n_bytes : CHUNK_SIZE;
+        if (memcmp(p, zero_chunk, n) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/* Compare the buffer against itself, shifted by one byte. */
+static bool
+zero_memcmp_shift(const void* data, size_t n_bytes)
+{
+    const uint8_t* p = (const uint8_t*)data;
+
+    if (n_bytes == 0) {
+        return true;
+    }
+    if (p[0] != 0) {
+        return false;
+    }
+
+    return memcmp(p, p + 1, n_bytes - 1) == 0;
+}
+
+
+/* Run func over buff for about the given time, and return the throughput in GB/s. */
+static double
+run(ZeroFunc func, const uint8_t* buff, size_t size, double seconds)
+{
+    volatile bool result;
+    uint64_t bytes = 0;
+    double start, elapsed;
+    int i;
+
+    start = now();
+    do {
+        for (i = 0; i < 64; i++) {
+            result = func(buff, size);
+        }
+        bytes += 64 * (uint64_t)size;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    (void)result;
+
+    return bytes / elapsed / 1e9;
+}
+
+
+int main(int argc, char* argv[]) {
+    static const size_t sizes[] = { 4096, 65536, 2 * 1024 * 1024 };
+    static const struct {
+        const char*	name;
+        ZeroFunc	func;
+    } funcs[] = {
+        { "memcmp 4K", zero_memcmp_chunks },
+        { "memcmp shift", zero_memcmp_shift },
+        { "mvhd_is_zero", mvhd_is_zero }
+    };
+    double seconds = (argc > 1) ? atof(argv[1]) : 0.5;
+    uint8_t* buff;
+    size_t s;
+    int f;
+
+    if (argc > 1 && seconds <= 0.0) {
+        printf("Expected args as follows:\n"
+               "minivhd_zbench [SECONDS]\n"
+               "Each check is run over zero filled buffers of 4 KB, 64 KB and a\n"
+               "whole block, for about SECONDS each.\n\n");
+        return 1;
+    }
+
+    buff = calloc(1, sizes[2]);
+    if (buff == NULL) {
+        printf("%s\n", mvhd_strerr(MVHD_ERR_MEM));
+        return EXIT_FAILURE;
+    }
+
+    /* Check that they all agree first, with a byte set at the very end */
+    for (f = 0; f < 3; f++) {
+        buff[sizes[2] - 1] = 1;
+        if (funcs[f].func(buff, sizes[2]) || !funcs[f].func(buff, sizes[2] - 1)) {
+            printf("%s gives the wrong result!\n", funcs[f].name);
+            return EXIT_FAILURE;
+        }
+        buff[sizes[2] - 1] = 0;
+    }
+
+    printf("%-14s", "GB/s");
+    for (s = 0; s < 3; s++) {
+        printf("%10zu", sizes[s]);
+    }
+    printf("\n");
+    for (f = 0; f < 3; f++) {
+        printf("%-14s", funcs[f].name);
+        for (s = 0; s < 3; s++) {
+            printf("%10.2f", run(funcs[f].func, buff, sizes[s], seconds));
+        }
+        printf("\n");
+    }
+
+    free(buff);
+
+    return EXIT_SUCCESS;
+}